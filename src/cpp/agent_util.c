@@ -155,40 +155,122 @@ allocate(jvmtiEnv *jvmti, jint len)
     return ptr;
 }
 
-char* get_class_name(jvmtiEnv* jvmti, JNIEnv* env, jclass klass)
+static const char* primitive_type_name(char c)
 {
-	jstring name;
-	char* classname;
-	if (NULL == klass)
+	switch (c)
 	{
-		fatal_error("klass is NULL at %s:%d\n", __FILE__, __LINE__);
+	case 'Z': return "boolean";
+	case 'B': return "byte";
+	case 'C': return "char";
+	case 'S': return "short";
+	case 'I': return "int";
+	case 'J': return "long";
+	case 'F': return "float";
+	case 'D': return "double";
+	case 'V': return "void";
+	default: return NULL;
 	}
-	name = (jstring)(*env)->CallObjectMethod(env, klass, getThreadData()->metGetClassName);
-	if (NULL == name)
+}
+
+/* Converts a JVM type signature (e.g. "[Ljava/util/HashMap$KeySet;") into the name
+ * Class.getCanonicalName() would return ("java.util.HashMap.KeySet[]").
+ * A '$' is treated as a nesting separator only when it sits between two identifier
+ * parts, so anonymous and local classes (Outer$1, Outer$1Local) and synthetic
+ * names (Foo$$Proxy, $Proxy12) keep their binary name.
+ * Writes up to size-1 characters to buf and returns the length of the full name, snprintf style. */
+int signature_to_class_name(const char* sig, char* buf, int size)
+{
+	int dims = 0, len = 0;
+	const char* p;
+
+#define PUT_CHAR(c) do { if (len + 1 < size) buf[len] = (c); len++; } while (0)
+
+	while ('[' == *sig)
 	{
-		char* sig;
-	    jint err = (*jvmti)->GetClassSignature(jvmti, klass, &sig, NULL);
-	    check_jvmti_error(jvmti, err, "get class signature");
-	    if (sig == NULL)
-	    {
-	        fatal_error("ERROR: No class signature found\n");
-	    }
-		classname = myStrdup(sig);
-	    deallocate(jvmti, sig);
-	    return classname;
+		dims++;
+		sig++;
+	}
+	if ('L' == *sig)
+	{
+		for (p = sig + 1; *p && (';' != *p); p++)
+		{
+			char c = *p;
+			if ('/' == c)
+			{
+				c = '.';
+			}
+			else if (('$' == c) && (p > sig + 1) && ('/' != p[-1]) && ('$' != p[-1]) &&
+					(';' != p[1]) && ('$' != p[1]) && !(p[1] >= '0' && p[1] <= '9'))
+			{
+				c = '.';
+			}
+			PUT_CHAR(c);
+		}
 	}
 	else
 	{
-		const char* classnameJava;
+		const char* primitive = primitive_type_name(*sig);
+		for (p = (NULL == primitive) ? sig : primitive; *p; p++)
+		{
+			PUT_CHAR(*p);
+		}
+	}
+	while (dims-- > 0)
+	{
+		PUT_CHAR('[');
+		PUT_CHAR(']');
+	}
+#undef PUT_CHAR
 
-		classnameJava = (*env)->GetStringUTFChars(env, name, NULL);
-		classname = myStrdup(classnameJava);
-		(*env)->ReleaseStringUTFChars(env, name, classnameJava);
-		(*env)->DeleteLocalRef(env, name);
+	if (size > 0)
+	{
+		buf[(len < size) ? len : size - 1] = 0;
 	}
+	return len;
+}
 
+/* Tells whether a class signature names a nested (member, local or anonymous) class,
+ * using the same '$' rules as signature_to_class_name() */
+jboolean is_nested_class_signature(const char* sig)
+{
+	const char* p;
+	if ('L' != *sig)
+	{
+		return JNI_FALSE;
+	}
+	for (p = sig + 1; *p && (';' != *p); p++)
+	{
+		if (('$' == *p) && (p > sig + 1) && ('/' != p[-1]) && ('$' != p[-1]) && (';' != p[1]) && ('$' != p[1]))
+		{
+			return JNI_TRUE;
+		}
+	}
+	return JNI_FALSE;
+}
+
+char* get_class_name(jvmtiEnv* jvmti, __UNUSED__ JNIEnv* env, jclass klass)
+{
+	char* sig;
+	char* classname;
+	int len;
+	jint err;
+
+	if (NULL == klass)
+	{
+		fatal_error("klass is NULL at %s:%d\n", __FILE__, __LINE__);
+	}
+	err = (*jvmti)->GetClassSignature(jvmti, klass, &sig, NULL);
+	check_jvmti_error(jvmti, err, "get class signature");
+	if (sig == NULL)
+	{
+		fatal_error("ERROR: No class signature found\n");
+	}
+	len = signature_to_class_name(sig, NULL, 0);
+	classname = myAlloc(len + 1);
+	signature_to_class_name(sig, classname, len + 1);
+	deallocate(jvmti, sig);
 
-    return classname;
+	return classname;
 }
 
 char* escapeString(const char* s)
@@ -63,6 +63,8 @@ void  check_jvmti_error(jvmtiEnv *jvmti, jvmtiError errnum, const char *str);
 void  deallocate(jvmtiEnv *jvmti, void *ptr);
 void *allocate(jvmtiEnv *jvmti, jint len);
 char* get_class_name(jvmtiEnv* jvmti, JNIEnv* env, jclass klass);
+int signature_to_class_name(const char* sig, char* buf, int size);
+jboolean is_nested_class_signature(const char* sig);
 int establish_connection(int port);
 void close_connection();
 void echo(const char * format, ...);
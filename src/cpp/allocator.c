@@ -1,14 +1,116 @@
 #include "allocator.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef WIN32
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/types.h>
+#	include <unistd.h>
+#endif
 
 #define BUF_SIZE 4096
 #define FILE_LINE_BUF_SIZE 128
+#define ARENA_CHUNK_SIZE (256*1024)
+#define ARENA_ALIGNMENT 8
+#define ARENA_ALIGN(x) (((x) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+/* mapped chunks are whole multiples of this, a multiple of any page size in use */
+#define MAPPED_CHUNK_GRANULARITY (64*1024)
+/* chunk size of arenas on huge pages, the usual huge page size */
+#define HUGE_PAGE_SIZE (2*1024*1024)
 
+/* On threads that keep a cache, blocks of up to 4K (header included) come in power of two
+ * size classes, and freed ones are kept on per-thread free lists for reuse. Bigger blocks,
+ * and all blocks of other threads, go straight to malloc at their exact size. */
+#define SIZE_CLASSES 8
+#define MIN_CLASS_SIZE 32
+#define CLASS_SIZE(c) ((size_t)MIN_CLASS_SIZE << (c))
+#define NO_SIZE_CLASS SIZE_CLASSES
+/* beyond this, freed blocks of a class are returned to malloc */
+#define FREE_LIST_MAX_BLOCKS 128
 
-static int allocations = 0;
-static int frees = 0;
+#ifdef WIN32
+#	define THREAD_LOCAL __declspec(thread)
+#	ifdef _WIN64
+#		define ATOMIC_ADD(p, v) ((size_t)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)) + (size_t)(v))
+#		define ATOMIC_CAS(p, o, n) ((size_t)InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(n), (LONG64)(o)))
+#	else
+#		define ATOMIC_ADD(p, v) ((size_t)InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v)) + (size_t)(v))
+#		define ATOMIC_CAS(p, o, n) ((size_t)InterlockedCompareExchange((volatile LONG*)(p), (LONG)(n), (LONG)(o)))
+#	endif
+#	define ATOMIC_SUB(p, v) ATOMIC_ADD(p, (size_t)0 - (size_t)(v))
+#	define ATOMIC_SWAP(p, v) InterlockedExchange((volatile LONG*)(p), (LONG)(v))
+#	define ATOMIC_CLEAR(p) InterlockedExchange((volatile LONG*)(p), 0)
+#	define ATOMIC_BARRIER() MemoryBarrier()
+#else
+#	define THREAD_LOCAL __thread
+#	define ATOMIC_ADD(p, v) __sync_add_and_fetch(p, v)
+#	define ATOMIC_SUB(p, v) __sync_sub_and_fetch(p, v)
+#	define ATOMIC_CAS(p, o, n) __sync_val_compare_and_swap(p, o, n)
+#	define ATOMIC_SWAP(p, v) __sync_lock_test_and_set(p, v)
+#	define ATOMIC_CLEAR(p) __sync_lock_release(p)
+#	define ATOMIC_BARRIER() __sync_synchronize()
+#endif
+
+/* Call sites of myAlloc, keyed by the __FILE__ pointer and the line. Index 0 means untracked. */
+#define MAX_ALLOCATION_SITES 1024
+/* the block header keeps the size class in the low bits, then the long lived flag, and the
+ * call site above them */
+#define SIZE_CLASS_BITS 4
+#define LONG_LIVED_BLOCK ((size_t)1 << SIZE_CLASS_BITS)
+#define SITE_SHIFT (SIZE_CLASS_BITS + 1)
+#define BLOCK_INFO(c, site) (((size_t)(site) << SITE_SHIFT) | (c))
+#define BLOCK_SIZE_CLASS(info) ((info) & (((size_t)1 << SIZE_CLASS_BITS) - 1))
+#define BLOCK_SITE(info) ((unsigned int)((info) >> SITE_SHIFT))
+
+
+static volatile size_t allocations = 0;
+static volatile size_t frees = 0;
 static int selfCheck = 0;
+static volatile size_t bytesInUse = 0;
+static volatile size_t peakBytesInUse = 0;
+static size_t budget = 0;
+/* guards the list of allocated blocks kept in self check mode */
+static volatile long selfCheckLock = 0;
+
+typedef struct
+{
+	const char* volatile file;
+	int line;
+	volatile size_t count;
+	volatile size_t currentBytes;
+	volatile size_t peakBytes;
+} AllocationSite;
+
+static int trackSites = 0;
+static AllocationSite sites[MAX_ALLOCATION_SITES];
+/* guards adding call sites; lookups don't take it */
+static volatile long sitesLock = 0;
+
+/* Every block starts with its size, so the memory held by the agent is known */
+typedef struct
+{
+	/* the bytes taken from malloc, header and size class rounding included */
+	size_t size;
+	/* BLOCK_INFO of the size class, NO_SIZE_CLASS for blocks that are freed to malloc, and
+	 * the allocation site, plus LONG_LIVED_BLOCK. Also keeps the payload aligned like malloc's */
+	size_t info;
+} BlockHeader;
+
+typedef struct
+{
+	BlockHeader* head;
+	int count;
+} FreeList;
+
+/* the next free block is kept in the payload of a cached block */
+#define NEXT_FREE_BLOCK(b) (*(BlockHeader**)((b) + 1))
+
+static THREAD_LOCAL FreeList freeLists[SIZE_CLASSES];
+/* threads that may end without releasing their cache don't keep one */
+static THREAD_LOCAL int cacheEnabled = 0;
+/* blocks allocated meanwhile by the thread are left out of the leak check */
+static THREAD_LOCAL int longLived = 0;
 
 struct MallocatedNode
 {
@@ -24,32 +126,247 @@ void initAllocator(int _selfCheck)
 	allocations = 0;
 	frees = 0;
 	selfCheck = _selfCheck;
-	memset(&head, sizeof(head), 0);
-	memset(&tail, sizeof(tail), 0);
+	memset(&head, 0, sizeof(head));
+	memset(&tail, 0, sizeof(tail));
 	head.next = &tail;
 	tail.prev = &head;
 }
 
+static void spinLock(volatile long* lock)
+{
+	while (ATOMIC_SWAP(lock, 1))
+	{
+		while (*lock)
+			;
+	}
+}
+
+static void spinUnlock(volatile long* lock)
+{
+	ATOMIC_CLEAR(lock);
+}
+
+static void raisePeak(volatile size_t* peak, size_t value)
+{
+	size_t current = *peak;
+	while (value > current)
+	{
+		size_t seen = ATOMIC_CAS(peak, current, value);
+		if (seen == current)
+		{
+			break;
+		}
+		current = seen;
+	}
+}
+
 void fillMallocNode(struct MallocatedNode* n, const char* file, int line)
 {
 	n->file = file;
 	n->line = line;
+	spinLock(&selfCheckLock);
 	n->prev = tail.prev;
 	n->next = &tail;
 	tail.prev->next = n;
 	tail.prev = n;
+	spinUnlock(&selfCheckLock);
+}
+
+void enableAllocationSites()
+{
+	trackSites = 1;
+}
+
+/* Finds the site of file:line, adding it if needed. Returns 0 once the table is full. */
+static unsigned int findAllocationSite(const char* file, int line)
+{
+	unsigned int mask = MAX_ALLOCATION_SITES - 1;
+	unsigned int start = ((unsigned int)((size_t)file >> 3) ^ ((unsigned int)line * 0x9E3779B1U)) & mask;
+	unsigned int i = start;
+	int locked = 0;
+
+	for (;;)
+	{
+		const char* slotFile = sites[i].file;
+		if ((0 != i) && (slotFile == file) && (sites[i].line == line))
+		{
+			break;
+		}
+		if ((0 != i) && (NULL == slotFile))
+		{
+			if (!locked)
+			{
+				/* look again under the lock, another thread may be adding the same site */
+				spinLock(&sitesLock);
+				locked = 1;
+				continue;
+			}
+			sites[i].line = line;
+			/* the line must be visible before the file publishes the slot */
+			ATOMIC_BARRIER();
+			sites[i].file = file;
+			break;
+		}
+		i = (i + 1) & mask;
+		if (i == start)
+		{
+			i = 0;
+			break;
+		}
+	}
+	if (locked)
+	{
+		spinUnlock(&sitesLock);
+	}
+	return i;
+}
+
+static int comparePeakBytes(const void* a, const void* b)
+{
+	size_t pa = ((const AllocationSiteStats*)a)->peakBytes;
+	size_t pb = ((const AllocationSiteStats*)b)->peakBytes;
+	return (pa < pb) ? 1 : ((pa > pb) ? -1 : 0);
+}
+
+AllocationSiteStats* getAllocationSites(int* count)
+{
+	AllocationSiteStats* res = myAlloc(sizeof(*res) * MAX_ALLOCATION_SITES);
+	int i, n = 0;
+
+	for (i = 1; i < MAX_ALLOCATION_SITES; i++)
+	{
+		if (NULL != sites[i].file)
+		{
+			res[n].file = sites[i].file;
+			res[n].line = sites[i].line;
+			res[n].count = sites[i].count;
+			res[n].currentBytes = sites[i].currentBytes;
+			res[n].peakBytes = sites[i].peakBytes;
+			n++;
+		}
+	}
+	qsort(res, n, sizeof(*res), comparePeakBytes);
+	*count = n;
+	return res;
+}
+
+static size_t sizeClassOf(size_t blockSize)
+{
+	size_t c = 0;
+	while ((c < SIZE_CLASSES) && (CLASS_SIZE(c) < blockSize))
+	{
+		c++;
+	}
+	return c;
+}
+
+static BlockHeader* allocBlock(size_t blockSize)
+{
+	size_t c = cacheEnabled ? sizeClassOf(blockSize) : NO_SIZE_CLASS;
+	BlockHeader* block;
+
+	if (NO_SIZE_CLASS == c)
+	{
+		block = malloc(blockSize);
+		block->size = blockSize;
+	}
+	else
+	{
+		if (NULL != freeLists[c].head)
+		{
+			block = freeLists[c].head;
+			freeLists[c].head = NEXT_FREE_BLOCK(block);
+			freeLists[c].count--;
+		}
+		else
+		{
+			block = malloc(CLASS_SIZE(c));
+		}
+		block->size = CLASS_SIZE(c);
+	}
+	block->info = c;
+	return block;
+}
+
+static void freeBlock(BlockHeader* block)
+{
+	size_t c = BLOCK_SIZE_CLASS(block->info);
+
+	if ((NO_SIZE_CLASS == c) || !cacheEnabled || (freeLists[c].count >= FREE_LIST_MAX_BLOCKS))
+	{
+		free(block);
+		return;
+	}
+	NEXT_FREE_BLOCK(block) = freeLists[c].head;
+	freeLists[c].head = block;
+	freeLists[c].count++;
+}
+
+void beginLongLivedAllocations()
+{
+	longLived = 1;
+}
+
+void endLongLivedAllocations()
+{
+	longLived = 0;
+}
+
+void enableAllocatorCache()
+{
+	cacheEnabled = 1;
+}
+
+void releaseAllocatorCache()
+{
+	int c;
+	cacheEnabled = 0;
+	for (c = 0; c < SIZE_CLASSES; c++)
+	{
+		while (NULL != freeLists[c].head)
+		{
+			BlockHeader* next = NEXT_FREE_BLOCK(freeLists[c].head);
+			free(freeLists[c].head);
+			freeLists[c].head = next;
+		}
+		freeLists[c].count = 0;
+	}
 }
 
 void* _myAlloc(int sz, const char* file, int line)
 {
-	allocations++;
-	if (selfCheck)
+	BlockHeader* block;
+	unsigned int site = trackSites ? findAllocationSite(file, line) : 0;
+
+	if (selfCheck && !longLived)
 	{
-		struct MallocatedNode* ptr = malloc(sz + sizeof(struct MallocatedNode));
+		size_t blockSize = sz + sizeof(struct MallocatedNode) + sizeof(BlockHeader);
+		struct MallocatedNode* ptr = malloc(blockSize);
 		fillMallocNode(ptr, file, line);
-		return ptr + 1;
+		block = (BlockHeader*)(ptr + 1);
+		block->size = blockSize;
+		block->info = NO_SIZE_CLASS;
+	}
+	else
+	{
+		block = allocBlock(sz + sizeof(BlockHeader));
 	}
-	return malloc(sz);
+	block->info = BLOCK_INFO(block->info, site);
+	if (longLived)
+	{
+		block->info |= LONG_LIVED_BLOCK;
+	}
+	else
+	{
+		ATOMIC_ADD(&allocations, 1);
+	}
+	raisePeak(&peakBytesInUse, ATOMIC_ADD(&bytesInUse, block->size));
+	if (0 != site)
+	{
+		ATOMIC_ADD(&sites[site].count, 1);
+		raisePeak(&sites[site].peakBytes, ATOMIC_ADD(&sites[site].currentBytes, block->size));
+	}
+	return block + 1;
 }
 
 char* _myStrdup(const char* s, const char* file, int line)
@@ -61,18 +378,50 @@ char* _myStrdup(const char* s, const char* file, int line)
 
 void myFree(void* p)
 {
-	frees++;
-	if (selfCheck)
+	BlockHeader* block = (BlockHeader*)p - 1;
+	unsigned int site = BLOCK_SITE(block->info);
+	if (0 == (block->info & LONG_LIVED_BLOCK))
 	{
-		struct MallocatedNode* ptr = (struct MallocatedNode*)p - 1;
+		ATOMIC_ADD(&frees, 1);
+	}
+	ATOMIC_SUB(&bytesInUse, block->size);
+	if (0 != site)
+	{
+		ATOMIC_SUB(&sites[site].currentBytes, block->size);
+	}
+	if (selfCheck && (0 == (block->info & LONG_LIVED_BLOCK)))
+	{
+		struct MallocatedNode* ptr = (struct MallocatedNode*)block - 1;
 
+		spinLock(&selfCheckLock);
 		ptr->prev->next = ptr->next;
 		ptr->next->prev = ptr->prev;
+		spinUnlock(&selfCheckLock);
 
 		free(ptr);
 		return;
 	}
-	free(p);
+	freeBlock(block);
+}
+
+void setAllocatorBudget(size_t maxBytes)
+{
+	budget = maxBytes;
+}
+
+int isAllocatorBudgetExhausted()
+{
+	return (0 != budget) && (bytesInUse >= budget);
+}
+
+size_t getAllocatorBytesInUse()
+{
+	return bytesInUse;
+}
+
+size_t getAllocatorPeakBytes()
+{
+	return peakBytesInUse;
 }
 
 char* findInternalMallocsLeaks()
@@ -80,17 +429,212 @@ char* findInternalMallocsLeaks()
 	if (allocations != frees)
 	{
 		char* buf = malloc(BUF_SIZE);
-		int pos = snprintf(buf, BUF_SIZE, "number of mallocs %d, number of frees %d\n", allocations, frees);
+		int pos = snprintf(buf, BUF_SIZE, "number of mallocs %lu, number of frees %lu\n", (unsigned long)allocations, (unsigned long)frees);
+		spinLock(&selfCheckLock);
 		while (head.next != &tail)
 		{
 			struct MallocatedNode* n = head.next->next;
-			int newPos = snprintf(buf + pos, BUF_SIZE - pos, "Didn't free memory allocated from %s:%d\n", head.next->file, head.next->line);
-			pos += newPos;
+			if (pos < BUF_SIZE)
+			{
+				pos += snprintf(buf + pos, BUF_SIZE - pos, "Didn't free memory allocated from %s:%d\n", head.next->file, head.next->line);
+			}
 			free(head.next);
 			head.next = n;
 		}
 		tail.prev = &head;
+		spinUnlock(&selfCheckLock);
 		return buf;
 	}
 	return NULL;
 }
+
+void arenaInit(Arena* a)
+{
+	memset(a, 0, sizeof(*a));
+	a->fd = -1;
+}
+
+int arenaInitMapped(Arena* a, const char* dir)
+{
+#ifdef WIN32
+	return 0;
+#else
+	char path[FILENAME_MAX];
+	int fd;
+
+	arenaInit(a);
+	if (snprintf(path, sizeof(path), "%s/jleaker-graph-XXXXXX", dir) >= (int)sizeof(path))
+	{
+		return 0;
+	}
+	fd = mkstemp(path);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	/* the file goes away with the descriptor, even if the process dies */
+	unlink(path);
+	a->mapped = 1;
+	a->fd = fd;
+	return 1;
+#endif
+}
+
+#ifndef WIN32
+/* Anonymous chunks on explicit huge pages when some are reserved, else on pages the kernel may
+ * merge into transparent huge pages. Returns NULL if neither can be mapped. */
+static ArenaChunk* newHugePageChunk(size_t size)
+{
+	size_t mapSize = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	ArenaChunk* chunk;
+	void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (MAP_FAILED == p)
+	{
+		p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == p)
+		{
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		/* only a hint: without transparent huge pages the chunk stays on normal pages */
+		(void)madvise(p, mapSize, MADV_HUGEPAGE);
+#endif
+	}
+	chunk = (ArenaChunk*)p;
+	chunk->size = mapSize;
+	chunk->mapped = CHUNK_ANONYMOUS;
+	/* unlike the scratch file, this is memory the agent holds */
+	raisePeak(&peakBytesInUse, ATOMIC_ADD(&bytesInUse, mapSize));
+	return chunk;
+}
+#endif
+
+void arenaUseHugePages(Arena* a)
+{
+	a->hugePages = 1;
+}
+
+static ArenaChunk* newArenaChunk(Arena* a, size_t size, const char* file, int line)
+{
+	ArenaChunk* chunk;
+#ifndef WIN32
+	if (a->hugePages && !a->mapped)
+	{
+		chunk = newHugePageChunk(size);
+		if (NULL != chunk)
+		{
+			return chunk;
+		}
+	}
+	if (a->mapped)
+	{
+		size_t mapSize = (size + MAPPED_CHUNK_GRANULARITY - 1) & ~(size_t)(MAPPED_CHUNK_GRANULARITY - 1);
+		if (0 == ftruncate(a->fd, (off_t)(a->file_size + mapSize)))
+		{
+			void* p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, (off_t)a->file_size);
+			if (MAP_FAILED != p)
+			{
+				a->file_size += mapSize;
+				chunk = (ArenaChunk*)p;
+				chunk->size = mapSize;
+				chunk->mapped = CHUNK_FILE;
+				return chunk;
+			}
+		}
+		/* out of scratch space: carry on from the heap */
+	}
+#endif
+	chunk = _myAlloc((int)size, file, line);
+	chunk->size = size;
+	chunk->mapped = CHUNK_HEAP;
+	return chunk;
+}
+
+void* _arenaAlloc(Arena* a, int sz, const char* file, int line)
+{
+	size_t size = ARENA_ALIGN((size_t)sz);
+	char* res;
+
+	if ((size_t)(a->end - a->ptr) < size)
+	{
+		/* big requests get a chunk of their own, so the current chunk keeps its free space */
+		size_t header = ARENA_ALIGN(sizeof(ArenaChunk));
+		size_t chunkSize = a->hugePages ? HUGE_PAGE_SIZE : ARENA_CHUNK_SIZE;
+		size_t payload = (size > chunkSize / 4) ? size : chunkSize - header;
+		ArenaChunk* chunk = newArenaChunk(a, header + payload, file, line);
+
+		a->allocated += chunk->size;
+		if (payload == size)
+		{
+			if (NULL == a->chunks)
+			{
+				chunk->next = NULL;
+				a->chunks = chunk;
+			}
+			else
+			{
+				chunk->next = a->chunks->next;
+				a->chunks->next = chunk;
+			}
+			return (char*)chunk + header;
+		}
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		a->ptr = (char*)chunk + header;
+		a->end = a->ptr + payload;
+	}
+	res = a->ptr;
+	a->ptr += size;
+	return res;
+}
+
+void arenaRelease(Arena* a)
+{
+	int mapped = a->mapped, fd = a->fd, hugePages = a->hugePages;
+
+	while (NULL != a->chunks)
+	{
+		ArenaChunk* next = a->chunks->next;
+#ifndef WIN32
+		if (CHUNK_HEAP != a->chunks->mapped)
+		{
+			if (CHUNK_ANONYMOUS == a->chunks->mapped)
+			{
+				ATOMIC_SUB(&bytesInUse, a->chunks->size);
+			}
+			munmap(a->chunks, a->chunks->size);
+		}
+		else
+#endif
+		{
+			myFree(a->chunks);
+		}
+		a->chunks = next;
+	}
+#ifndef WIN32
+	if (mapped)
+	{
+		(void)ftruncate(fd, 0);
+	}
+#endif
+	memset(a, 0, sizeof(*a));
+	a->mapped = mapped;
+	a->fd = fd;
+	a->hugePages = hugePages;
+}
+
+void arenaClose(Arena* a)
+{
+	arenaRelease(a);
+#ifndef WIN32
+	if (a->mapped)
+	{
+		close(a->fd);
+	}
+#endif
+	arenaInit(a);
+}
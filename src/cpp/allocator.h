@@ -22,6 +22,80 @@ void* _myAlloc(int sz, const char* file, int line);
 char* _myStrdup(const char* s, const char* file, int line);
 void myFree(void* p);
 char* findInternalMallocsLeaks();
+/* Blocks the calling thread allocates in between outlive the dumps, so findInternalMallocsLeaks
+ * doesn't expect them freed, not even in self check mode. */
+void beginLongLivedAllocations();
+void endLongLivedAllocations();
+/* Lets the calling thread keep freed blocks for reuse. It must call releaseAllocatorCache
+ * before it ends, which returns the cached blocks to malloc. */
+void enableAllocatorCache();
+void releaseAllocatorCache();
+
+/* Per call site accounting of myAlloc, off until enabled */
+typedef struct
+{
+	const char* file;
+	int line;
+	/* number of allocations */
+	size_t count;
+	/* bytes taken from malloc, headers and size class rounding included */
+	size_t currentBytes;
+	size_t peakBytes;
+} AllocationSiteStats;
+
+void enableAllocationSites();
+/* Returns the call sites seen so far, largest peak first. The array is freed with myFree. */
+AllocationSiteStats* getAllocationSites(int* count);
+
+/* Memory budget: allocations never fail, the budget is a signal that the
+ * graph capture checks to stop growing. 0 means no limit. */
+void setAllocatorBudget(size_t maxBytes);
+int isAllocatorBudgetExhausted();
+size_t getAllocatorBytesInUse();
+size_t getAllocatorPeakBytes();
+
+/* Bump allocator for objects that share a lifetime: allocation is a pointer increment
+ * and everything is released at once. Individual objects cannot be freed. */
+#define CHUNK_HEAP 0
+#define CHUNK_FILE 1
+#define CHUNK_ANONYMOUS 2
+
+typedef struct _ArenaChunk
+{
+	struct _ArenaChunk* next;
+	size_t size;
+	/* where the chunk comes from, one of CHUNK_* */
+	int mapped;
+} ArenaChunk;
+
+typedef struct
+{
+	ArenaChunk* chunks;
+	char* ptr;
+	char* end;
+	size_t allocated;
+	/* when mapped, chunks are mappings of the scratch file fd, which is file_size long */
+	int mapped;
+	int fd;
+	size_t file_size;
+	/* chunks are taken from huge pages when possible */
+	int hugePages;
+} Arena;
+
+#define arenaAlloc(a, x) (_arenaAlloc(a, x, __FILE__, __LINE__))
+
+void arenaInit(Arena* a);
+/* Takes chunks from an unlinked file in dir, so the kernel can write them out under
+ * memory pressure. Returns 0 if the file can't be created; the arena then stays on the heap. */
+int arenaInitMapped(Arena* a, const char* dir);
+/* Takes 2MB chunks from huge pages, falling back to normal pages and then to the heap.
+ * Ignored by a mapped arena. */
+void arenaUseHugePages(Arena* a);
+void* _arenaAlloc(Arena* a, int sz, const char* file, int line);
+/* Frees all the objects; a mapped arena keeps its (now empty) file */
+void arenaRelease(Arena* a);
+/* Frees all the objects and closes the scratch file */
+void arenaClose(Arena* a);
 
 #endif
 
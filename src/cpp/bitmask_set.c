@@ -3,106 +3,378 @@
 #include <string.h>
 #include "allocator.h"
 
-#define SIZE_IN_BYTES(sz) 1+(sz>>3)
+#define IS_COMPRESSED(s) (NULL == (s)->words)
+#define SIZE_IN_WORDS(sz) (1+((sz)>>6))
+#define BIT(n) (((uint64_t)1)<<((n)&63))
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define BITMASK_SET_AVX2
+#	include <immintrin.h>
+#endif
+
+/*
+ * The kernels walk the sets 64 bits at a time. On x86 an AVX2 variant,
+ * handling 256 bits per step, is selected at runtime when the CPU has it.
+ */
+typedef void (*OrWithExclusionKernel)(uint64_t* s, const uint64_t* o, const uint64_t* e, int words);
+typedef int (*ContainsAllKernel)(const uint64_t* s, const uint64_t* o, int words);
+typedef int (*IsEmptyKernel)(const uint64_t* s, int words);
+
+static void orWithExclusionWords(uint64_t* s, const uint64_t* o, const uint64_t* e, int words)
+{
+	int i;
+	for (i = 0; i < words; i++) s[i] |= (o[i] & ~e[i]);
+}
+
+static int containsAllWords(const uint64_t* s, const uint64_t* o, int words)
+{
+	int i;
+	for (i = 0; i < words; i++) if ((s[i] & o[i]) != o[i]) return 0;
+	return 1;
+}
+
+static int isEmptyWords(const uint64_t* s, int words)
+{
+	int i;
+	for (i = 0; i < words; i++) if (s[i] != 0) return 0;
+	return 1;
+}
+
+#ifdef BITMASK_SET_AVX2
+__attribute__((target("avx2")))
+static void orWithExclusionAvx2(uint64_t* s, const uint64_t* o, const uint64_t* e, int words)
+{
+	int i;
+	for (i = 0; i + 4 <= words; i += 4)
+	{
+		__m256i vs = _mm256_loadu_si256((const __m256i*)(s + i));
+		__m256i vo = _mm256_loadu_si256((const __m256i*)(o + i));
+		__m256i ve = _mm256_loadu_si256((const __m256i*)(e + i));
+		_mm256_storeu_si256((__m256i*)(s + i), _mm256_or_si256(vs, _mm256_andnot_si256(ve, vo)));
+	}
+	orWithExclusionWords(s + i, o + i, e + i, words - i);
+}
+
+__attribute__((target("avx2")))
+static int containsAllAvx2(const uint64_t* s, const uint64_t* o, int words)
+{
+	int i;
+	for (i = 0; i + 4 <= words; i += 4)
+	{
+		__m256i vs = _mm256_loadu_si256((const __m256i*)(s + i));
+		__m256i vo = _mm256_loadu_si256((const __m256i*)(o + i));
+		/* o & ~s must be all zeros */
+		if (!_mm256_testc_si256(vs, vo)) return 0;
+	}
+	return containsAllWords(s + i, o + i, words - i);
+}
+
+__attribute__((target("avx2")))
+static int isEmptyAvx2(const uint64_t* s, int words)
+{
+	int i;
+	for (i = 0; i + 4 <= words; i += 4)
+	{
+		__m256i vs = _mm256_loadu_si256((const __m256i*)(s + i));
+		if (!_mm256_testz_si256(vs, vs)) return 0;
+	}
+	return isEmptyWords(s + i, words - i);
+}
+#endif
+
+static OrWithExclusionKernel orWithExclusion = &orWithExclusionWords;
+static ContainsAllKernel containsAll = &containsAllWords;
+static IsEmptyKernel isEmpty = &isEmptyWords;
+static int kernelsSelected = 0;
+
+/* Every set goes through a constructor first, so the choice is made before any kernel runs */
+static void selectKernels()
+{
+#ifdef BITMASK_SET_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		orWithExclusion = &orWithExclusionAvx2;
+		containsAll = &containsAllAvx2;
+		isEmpty = &isEmptyAvx2;
+	}
+#endif
+	kernelsSelected = 1;
+}
 
 bitmask_set* bitMaskSet_new(int size)
 {
 	bitmask_set* s = myAlloc(sizeof(*s));
-	int sizeToAlloc = SIZE_IN_BYTES(size);
+	int sizeToAlloc = SIZE_IN_WORDS(size) * sizeof(uint64_t);
 
+	if (!kernelsSelected)
+	{
+		selectKernels();
+	}
 	s->size = size;
-	s->ptr = myAlloc(sizeToAlloc);
-	memset(s->ptr, 0, sizeToAlloc);
+	s->words = (size <= BITMASK_SET_INLINE_BITS) ? s->u.inline_words : myAlloc(sizeToAlloc);
+	memset(s->words, 0, sizeToAlloc);
 	return s;
 }
 
+/* Sets an embedded set up; bits that do not fit inline come from the arena and go with it */
+void bitMaskSet_initInArena(bitmask_set* s, Arena* a, int size)
+{
+	int sizeToAlloc = SIZE_IN_WORDS(size) * sizeof(uint64_t);
+
+	if (!kernelsSelected)
+	{
+		selectKernels();
+	}
+	s->size = size;
+	if (size <= BITMASK_SET_INLINE_BITS)
+	{
+		s->words = s->u.inline_words;
+	}
+	else
+	{
+		s->words = arenaAlloc(a, sizeToAlloc);
+	}
+	memset(s->words, 0, sizeToAlloc);
+}
+
+bitmask_set* bitMaskSet_newCompressed(int size)
+{
+	bitmask_set* s = myAlloc(sizeof(*s));
+	bitMaskSet_initCompressed(s, size);
+	return s;
+}
+
+void bitMaskSet_initCompressed(bitmask_set* s, int size)
+{
+	if (!kernelsSelected)
+	{
+		selectKernels();
+	}
+	s->size = size;
+	s->words = NULL;
+	compressedSet_init(&s->u.compressed);
+}
+
+void bitMaskSet_release(bitmask_set* s)
+{
+	if (IS_COMPRESSED(s))
+	{
+		compressedSet_release(&s->u.compressed);
+	}
+}
+
 void bitMaskSet_free(bitmask_set** s)
 {
 	if (NULL == *s)
 	{
 		return;
 	}
-	myFree((*s)->ptr);
+	if (IS_COMPRESSED(*s))
+	{
+		compressedSet_release(&(*s)->u.compressed);
+	}
+	else if ((*s)->words != (*s)->u.inline_words)
+	{
+		myFree((*s)->words);
+	}
 	myFree(*s);
 	*s = NULL;
 }
 
 void bitMapSet_add(bitmask_set* s, int n)
 {
-	unsigned char* p;
 	if (n >= s->size)
 	{
 		return;
 	}
-	p = (unsigned char*)s->ptr;
-	*(p+(n>>3)) |= (1<<(n&7));
+	if (IS_COMPRESSED(s))
+	{
+		compressedSet_add(&s->u.compressed, n);
+		return;
+	}
+	s->words[n>>6] |= BIT(n);
 }
 
 void bitMapSet_remove(bitmask_set* s, int n)
 {
-	unsigned char* p;
 	if (n >= s->size)
 	{
 		return;
 	}
-	p = (unsigned char*)s->ptr;
-	*(p+(n>>3)) &= (unsigned char)(~(1<<(n&7)));
+	if (IS_COMPRESSED(s))
+	{
+		compressedSet_remove(&s->u.compressed, n);
+		return;
+	}
+	s->words[n>>6] &= ~BIT(n);
+}
+
+int bitMapSet_contains(bitmask_set* s, int n)
+{
+	if (n >= s->size)
+	{
+		return 0;
+	}
+	if (IS_COMPRESSED(s))
+	{
+		return compressedSet_contains(&s->u.compressed, n);
+	}
+	return (s->words[n>>6] & BIT(n))?1:0;
+}
+
+/* Smallest member of s that is >= from, or -1 */
+static int nextMember(bitmask_set* s, int from)
+{
+	int i, n, size = SIZE_IN_WORDS(s->size);
+	uint64_t w;
+
+	if (from >= s->size)
+	{
+		return -1;
+	}
+	if (IS_COMPRESSED(s))
+	{
+		n = compressedSet_next(&s->u.compressed, from);
+		return (n < s->size) ? n : -1;
+	}
+	i = from >> 6;
+	w = s->words[i] & (~(uint64_t)0 << (from & 63));
+	while (0 == w)
+	{
+		if (++i >= size)
+		{
+			return -1;
+		}
+		w = s->words[i];
+	}
+	n = (i << 6) + lowestBit64(w);
+	return (n < s->size) ? n : -1;
+}
+
+/* Sets of different representations are combined member by member */
+static void addAllMembers(bitmask_set* s, bitmask_set* o, bitmask_set* e)
+{
+	int n, minSize = (s->size < o->size)?s->size:o->size;
+	for (n = nextMember(o, 0); (n >= 0) && (n < minSize); n = nextMember(o, n + 1))
+	{
+		if ((NULL == e) || !bitMapSet_contains(e, n))
+		{
+			bitMapSet_add(s, n);
+		}
+	}
 }
 
 void bitMapSet_addAll(bitmask_set* s, bitmask_set* o)
 {
-	unsigned char* p1, *p2;
-	int minSize = (s->size < o->size)?s->size:o->size;
+	int minSize = SIZE_IN_WORDS((s->size < o->size)?s->size:o->size);
 	int i;
-	minSize = (minSize >> 3) + 1;
-	p1 = (unsigned char*)s->ptr;
-	p2 = (unsigned char*)o->ptr;
-	for (i = 0; i < minSize; i++, p1++, p2++) *p1 |= *p2;
+	if (IS_COMPRESSED(s) && IS_COMPRESSED(o))
+	{
+		compressedSet_addAll(&s->u.compressed, &o->u.compressed, NULL);
+		return;
+	}
+	if (IS_COMPRESSED(s) || IS_COMPRESSED(o))
+	{
+		addAllMembers(s, o, NULL);
+		return;
+	}
+	for (i = 0; i < minSize; i++) s->words[i] |= o->words[i];
 }
 
 void bitMapSet_addAllWithExclusion(bitmask_set* s, bitmask_set* o, bitmask_set* e)
 {
-	unsigned char* p1, *p2, *p3;
 	int minSize = (s->size < o->size)?s->size:o->size;
 	int exclSize = (minSize < e->size)?minSize:e->size;
 	int i;
-	minSize = SIZE_IN_BYTES(minSize);
-	exclSize = SIZE_IN_BYTES(exclSize);
-	p1 = (unsigned char*)s->ptr;
-	p2 = (unsigned char*)o->ptr;
-	p3 = (unsigned char*)e->ptr;
-	for (i = 0; i < exclSize; i++, p1++, p2++, p3++) *p1 |= (*p2 & ~*p3);
-	for (; i < minSize; i++, p1++, p2++) *p1 |= *p2;
+	if (IS_COMPRESSED(s) && IS_COMPRESSED(o) && IS_COMPRESSED(e))
+	{
+		compressedSet_addAll(&s->u.compressed, &o->u.compressed, &e->u.compressed);
+		return;
+	}
+	if (IS_COMPRESSED(s) || IS_COMPRESSED(o) || IS_COMPRESSED(e))
+	{
+		addAllMembers(s, o, e);
+		return;
+	}
+	minSize = SIZE_IN_WORDS(minSize);
+	exclSize = SIZE_IN_WORDS(exclSize);
+	orWithExclusion(s->words, o->words, e->words, exclSize);
+	for (i = exclSize; i < minSize; i++) s->words[i] |= o->words[i];
 }
 
 int bitMapSet_containsAll(bitmask_set* s, bitmask_set* o)
 {
-	unsigned char* p1, *p2;
-	int minSize;
-	int i;
-	minSize = SIZE_IN_BYTES((s->size < o->size)?s->size:o->size);
-	p1 = (unsigned char*)s->ptr;
-	p2 = (unsigned char*)o->ptr;
-	for (i = 0; i < minSize; i++, p1++, p2++) if ((*p1 & *p2) != *p2) return 0;
-	return 1;
+	int n, minSize = (s->size < o->size)?s->size:o->size;
+	if (IS_COMPRESSED(s) && IS_COMPRESSED(o))
+	{
+		return compressedSet_containsAll(&s->u.compressed, &o->u.compressed);
+	}
+	if (IS_COMPRESSED(s) || IS_COMPRESSED(o))
+	{
+		for (n = nextMember(o, 0); (n >= 0) && (n < minSize); n = nextMember(o, n + 1))
+		{
+			if (!bitMapSet_contains(s, n))
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+	return containsAll(s->words, o->words, SIZE_IN_WORDS(minSize));
 }
 
-int bitMapSet_contains(bitmask_set* s, int n)
+int bitMapSet_isEmpty(bitmask_set* s)
 {
-	unsigned char* p;
-	if (n >= s->size)
+	if (IS_COMPRESSED(s))
 	{
-		return 0;
+		return (0 == s->u.compressed.count);
 	}
-	p = (unsigned char*)s->ptr;
-	return (*(p+(n>>3)) & (1<<(n&7)))?1:0;
+	return isEmpty(s->words, SIZE_IN_WORDS(s->size));
 }
 
-int bitMapSet_isEmpty(bitmask_set* s)
+int bitMapSet_cardinality(bitmask_set* s)
 {
-	unsigned char* p1;
-	int i, size = SIZE_IN_BYTES(s->size);
-	p1 = (unsigned char*)s->ptr;
-	for (i = 0; i < size; i++, p1++) if (*p1 != 0) return 0;
-	return 1;
+	int i, count = 0, size = SIZE_IN_WORDS(s->size);
+	if (IS_COMPRESSED(s))
+	{
+		return compressedSet_cardinality(&s->u.compressed);
+	}
+	for (i = 0; i < size; i++) count += bitCount64(s->words[i]);
+	return count;
+}
+
+int bitMapSet_nextWithExclusion(bitmask_set* s, bitmask_set* e, int from)
+{
+	int i, size = SIZE_IN_WORDS(s->size);
+	uint64_t w;
+
+	if (from >= s->size)
+	{
+		return -1;
+	}
+	if (IS_COMPRESSED(s) || IS_COMPRESSED(e))
+	{
+		for (i = nextMember(s, from); (i >= 0) && bitMapSet_contains(e, i); i = nextMember(s, i + 1));
+		return i;
+	}
+	i = from >> 6;
+	w = s->words[i] & (~(uint64_t)0 << (from & 63));
+	for (;;)
+	{
+		if (i < SIZE_IN_WORDS(e->size))
+		{
+			w &= ~e->words[i];
+		}
+		if (0 != w)
+		{
+			int n = (i << 6) + lowestBit64(w);
+			return (n < s->size) ? n : -1;
+		}
+		if (++i >= size)
+		{
+			return -1;
+		}
+		w = s->words[i];
+	}
 }
@@ -1,13 +1,35 @@
 #ifndef _BITMASK_SET_INCLUDED_
 #define _BITMASK_SET_INCLUDED_
 
+#include <stdint.h>
+#include "allocator.h"
+#include "compressed_set.h"
+
+/* Sets of up to BITMASK_SET_INLINE_BITS members keep their words inside the struct */
+#define BITMASK_SET_INLINE_WORDS 2
+#define BITMASK_SET_INLINE_BITS (64 * BITMASK_SET_INLINE_WORDS - 1)
+
+/*
+ * words may point into the struct itself: an initialized set must not be copied by value.
+ * A compressed set has no words and keeps its members in u.compressed instead.
+ */
 typedef struct
 {
-	void* ptr;
+	uint64_t* words;
 	int size;
+	union
+	{
+		uint64_t inline_words[BITMASK_SET_INLINE_WORDS];
+		compressed_set compressed;
+	} u;
 } bitmask_set;
 
 bitmask_set* bitMaskSet_new(int size);
+bitmask_set* bitMaskSet_newCompressed(int size);
+void bitMaskSet_initInArena(bitmask_set* s, Arena* a, int size);
+void bitMaskSet_initCompressed(bitmask_set* s, int size);
+/* Releases what an embedded set holds outside its arena */
+void bitMaskSet_release(bitmask_set* s);
 void bitMaskSet_free(bitmask_set** s);
 void bitMapSet_add(bitmask_set* s, int n);
 void bitMapSet_remove(bitmask_set* s, int n);
@@ -16,6 +38,8 @@ void bitMapSet_addAll(bitmask_set* s, bitmask_set* o);
 void bitMapSet_addAllWithExclusion(bitmask_set* s, bitmask_set* o, bitmask_set* e);
 int bitMapSet_containsAll(bitmask_set* s, bitmask_set* o);
 int bitMapSet_isEmpty(bitmask_set* s);
+int bitMapSet_cardinality(bitmask_set* s);
+/* Smallest member of s not in e that is >= from, or -1 */
+int bitMapSet_nextWithExclusion(bitmask_set* s, bitmask_set* e, int from);
 
 #endif
-
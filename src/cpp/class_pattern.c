@@ -0,0 +1,256 @@
+#include "class_pattern.h"
+#include <string.h>
+#include "allocator.h"
+
+#define ROOT 0U
+#define NO_CHILD 0U
+
+ClassPatterns* classPatterns_new()
+{
+	ClassPatterns* p = myAlloc(sizeof(*p));
+	p->capacity = 64;
+	p->nodes = myAlloc(sizeof(*p->nodes) * p->capacity);
+	memset(&p->nodes[ROOT], 0, sizeof(p->nodes[ROOT]));
+	p->count = 1;
+	p->patterns = 0;
+	p->simple = 1;
+	return p;
+}
+
+void classPatterns_free(ClassPatterns** patterns)
+{
+	if (NULL == *patterns)
+	{
+		return;
+	}
+	myFree((*patterns)->nodes);
+	myFree(*patterns);
+	*patterns = NULL;
+}
+
+/* Whether the nodes form a trie as classPatterns_add builds it: children come after their parent
+ * and a node's next sibling before it, so every walk ends */
+static int isValidTrie(const ClassPatternNode* nodes, unsigned int count)
+{
+	unsigned int i;
+
+	if ((0 == count) || (NO_CHILD != nodes[ROOT].nextSibling))
+	{
+		return 0;
+	}
+	for (i = 0; i < count; i++)
+	{
+		const ClassPatternNode* n = &nodes[i];
+		if (((NO_CHILD != n->firstChild) && ((n->firstChild <= i) || (n->firstChild >= count))) ||
+				((NO_CHILD != n->star) && ((n->star <= i) || (n->star >= count))) ||
+				((NO_CHILD != n->any) && ((n->any <= i) || (n->any >= count))) ||
+				((NO_CHILD != n->nextSibling) && (n->nextSibling >= i)))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int classPatterns_load(ClassPatterns* p, const ClassPatternNode* nodes, unsigned int count, int patternCount, int simple)
+{
+	if (!isValidTrie(nodes, count) || (patternCount < 0))
+	{
+		return 0;
+	}
+	myFree(p->nodes);
+	p->nodes = myAlloc(sizeof(*p->nodes) * count);
+	memcpy(p->nodes, nodes, sizeof(*p->nodes) * count);
+	p->count = count;
+	p->capacity = count;
+	p->patterns = patternCount;
+	p->simple = simple;
+	return 1;
+}
+
+static unsigned int newNode(ClassPatterns* p, char c)
+{
+	ClassPatternNode* n;
+	if (p->count == p->capacity)
+	{
+		ClassPatternNode* nodes = myAlloc(sizeof(*nodes) * 2 * p->capacity);
+		memcpy(nodes, p->nodes, sizeof(*nodes) * p->count);
+		myFree(p->nodes);
+		p->nodes = nodes;
+		p->capacity *= 2;
+	}
+	n = &p->nodes[p->count];
+	memset(n, 0, sizeof(*n));
+	n->c = c;
+	return p->count++;
+}
+
+static unsigned int literalChild(const ClassPatterns* p, unsigned int node, char c)
+{
+	unsigned int child;
+	for (child = p->nodes[node].firstChild; NO_CHILD != child; child = p->nodes[child].nextSibling)
+	{
+		if (p->nodes[child].c == c)
+		{
+			break;
+		}
+	}
+	return child;
+}
+
+void classPatterns_add(ClassPatterns* p, const char* pattern)
+{
+	unsigned int node = ROOT;
+
+	if ('\0' == *pattern)
+	{
+		return;
+	}
+	for (; '\0' != *pattern; pattern++)
+	{
+		unsigned int child;
+		if ('*' == *pattern)
+		{
+			if (p->nodes[node].selfLoop)
+			{
+				/* "**" is the same as "*" */
+				continue;
+			}
+			child = p->nodes[node].star;
+			if (NO_CHILD == child)
+			{
+				child = newNode(p, '*');
+				p->nodes[child].selfLoop = 1;
+				p->nodes[node].star = child;
+			}
+		}
+		else if ('?' == *pattern)
+		{
+			p->simple = 0;
+			child = p->nodes[node].any;
+			if (NO_CHILD == child)
+			{
+				child = newNode(p, '?');
+				p->nodes[node].any = child;
+			}
+		}
+		else
+		{
+			child = literalChild(p, node, *pattern);
+			if (NO_CHILD == child)
+			{
+				child = newNode(p, *pattern);
+				p->nodes[child].nextSibling = p->nodes[node].firstChild;
+				p->nodes[node].firstChild = child;
+			}
+		}
+		if (p->nodes[node].selfLoop)
+		{
+			/* a '*' in the middle of a pattern */
+			p->simple = 0;
+		}
+		node = child;
+	}
+	p->nodes[node].terminal = 1;
+	p->patterns++;
+}
+
+/* Only literal characters and trailing '*' */
+static int matchSimple(const ClassPatterns* p, const char* name)
+{
+	unsigned int node = ROOT;
+	for (;;)
+	{
+		unsigned int star = p->nodes[node].star;
+		if ((NO_CHILD != star) && p->nodes[star].terminal)
+		{
+			return 1;
+		}
+		if ('\0' == *name)
+		{
+			return p->nodes[node].terminal;
+		}
+		node = literalChild(p, node, *name++);
+		if (NO_CHILD == node)
+		{
+			return 0;
+		}
+	}
+}
+
+/* Adds the node and the '*' node after it, which may match nothing */
+static void addState(const ClassPatterns* p, unsigned int node, unsigned int* states, int* count, unsigned char* active)
+{
+	while (!active[node])
+	{
+		active[node] = 1;
+		states[(*count)++] = node;
+		node = p->nodes[node].star;
+		if (NO_CHILD == node)
+		{
+			break;
+		}
+	}
+}
+
+/* Runs all the patterns at once over the name, keeping the set of trie nodes reached so far */
+static int matchGeneral(const ClassPatterns* p, const char* name)
+{
+	unsigned int* current = myAlloc(2 * sizeof(*current) * p->count);
+	unsigned int* next = current + p->count;
+	unsigned char* active = myAlloc(p->count);
+	int currentCount = 0, nextCount, i, res = 0;
+
+	memset(active, 0, p->count);
+	addState(p, ROOT, current, &currentCount, active);
+	for (; ('\0' != *name) && (currentCount > 0); name++)
+	{
+		unsigned int* tmp;
+		for (i = 0; i < currentCount; i++)
+		{
+			active[current[i]] = 0;
+		}
+		nextCount = 0;
+		for (i = 0; i < currentCount; i++)
+		{
+			const ClassPatternNode* n = &p->nodes[current[i]];
+			unsigned int child = literalChild(p, current[i], *name);
+			if (n->selfLoop)
+			{
+				addState(p, current[i], next, &nextCount, active);
+			}
+			if (NO_CHILD != n->any)
+			{
+				addState(p, n->any, next, &nextCount, active);
+			}
+			if (NO_CHILD != child)
+			{
+				addState(p, child, next, &nextCount, active);
+			}
+		}
+		tmp = current;
+		current = next;
+		next = tmp;
+		currentCount = nextCount;
+	}
+	for (i = 0; i < currentCount; i++)
+	{
+		if (p->nodes[current[i]].terminal)
+		{
+			res = 1;
+			break;
+		}
+	}
+	myFree((current < next) ? current : next);
+	myFree(active);
+	return res;
+}
+
+int classPatterns_match(const ClassPatterns* p, const char* name)
+{
+	if ((NULL == p) || (0 == p->patterns))
+	{
+		return 0;
+	}
+	return p->simple ? matchSimple(p, name) : matchGeneral(p, name);
+}
@@ -0,0 +1,40 @@
+#ifndef __CLASS_PATTERN_H__
+#define __CLASS_PATTERN_H__
+
+/* Class name patterns, compiled into a trie as they are added. A pattern is a class name
+ * that may hold '*' (any run of characters, dots included) and '?' (any one character),
+ * so "org.apache.log4j.*" ignores a whole package. */
+typedef struct
+{
+	/* index of the first child, 0 if none: the root is never a child */
+	unsigned int firstChild;
+	unsigned int nextSibling;
+	/* the child reached by '*' and the one reached by '?', 0 if none */
+	unsigned int star;
+	unsigned int any;
+	char c;
+	/* a '*' node, which also stays on any character */
+	unsigned char selfLoop;
+	/* a pattern ends here */
+	unsigned char terminal;
+} ClassPatternNode;
+
+typedef struct
+{
+	ClassPatternNode* nodes;
+	unsigned int count;
+	unsigned int capacity;
+	int patterns;
+	/* no '?' and '*' only at the end of patterns, so a match is one walk down the trie */
+	int simple;
+} ClassPatterns;
+
+ClassPatterns* classPatterns_new();
+void classPatterns_free(ClassPatterns** patterns);
+void classPatterns_add(ClassPatterns* patterns, const char* pattern);
+/* Replaces the patterns with a trie compiled earlier. Returns 0, leaving the patterns as they
+ * are, if the nodes don't form a valid trie. */
+int classPatterns_load(ClassPatterns* patterns, const ClassPatternNode* nodes, unsigned int count, int patternCount, int simple);
+int classPatterns_match(const ClassPatterns* patterns, const char* name);
+
+#endif
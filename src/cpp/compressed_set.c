@@ -0,0 +1,427 @@
+#include "compressed_set.h"
+#include <string.h>
+#include "allocator.h"
+
+#define CHUNK_OF(n) ((n) >> CSET_CHUNK_BITS)
+#define OFFSET_OF(n) ((n) & (CSET_CHUNK_SIZE - 1))
+#define BIT(n) (((uint64_t)1)<<((n)&63))
+
+int bitCount64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+int lowestBit64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	int n = 0;
+	while (0 == (x & 1))
+	{
+		x >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+/* Index of the value, or -(insertion point)-1 */
+static int arrayIndexOf(const CSetContainer* c, int offset)
+{
+	int lo = 0, hi = c->cardinality - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) >> 1;
+		if (c->values[mid] < offset)
+		{
+			lo = mid + 1;
+		}
+		else if (c->values[mid] > offset)
+		{
+			hi = mid - 1;
+		}
+		else
+		{
+			return mid;
+		}
+	}
+	return -(lo + 1);
+}
+
+static void convertToBitmap(CSetContainer* c)
+{
+	int i;
+	c->bits = myAlloc(sizeof(*c->bits) * CSET_BITMAP_WORDS);
+	memset(c->bits, 0, sizeof(*c->bits) * CSET_BITMAP_WORDS);
+	for (i = 0; i < c->cardinality; i++)
+	{
+		c->bits[c->values[i] >> 6] |= BIT(c->values[i]);
+	}
+	if (NULL != c->values)
+	{
+		myFree(c->values);
+		c->values = NULL;
+	}
+	c->capacity = 0;
+}
+
+static int containerContains(const CSetContainer* c, int offset)
+{
+	if (NULL != c->bits)
+	{
+		return (c->bits[offset >> 6] & BIT(offset)) ? 1 : 0;
+	}
+	return (arrayIndexOf(c, offset) >= 0) ? 1 : 0;
+}
+
+static void containerAdd(CSetContainer* c, int offset)
+{
+	int i;
+	if (NULL == c->bits)
+	{
+		i = arrayIndexOf(c, offset);
+		if (i >= 0)
+		{
+			return;
+		}
+		if (c->cardinality < CSET_ARRAY_MAX)
+		{
+			i = -(i + 1);
+			if (c->cardinality == c->capacity)
+			{
+				unsigned short* values;
+				c->capacity = (0 == c->capacity) ? 4 : 2 * c->capacity;
+				values = myAlloc(sizeof(*values) * c->capacity);
+				if (NULL != c->values)
+				{
+					memcpy(values, c->values, sizeof(*values) * c->cardinality);
+					myFree(c->values);
+				}
+				c->values = values;
+			}
+			memmove(&c->values[i + 1], &c->values[i], sizeof(*c->values) * (c->cardinality - i));
+			c->values[i] = (unsigned short)offset;
+			c->cardinality++;
+			return;
+		}
+		convertToBitmap(c);
+	}
+	if (0 == (c->bits[offset >> 6] & BIT(offset)))
+	{
+		c->bits[offset >> 6] |= BIT(offset);
+		c->cardinality++;
+	}
+}
+
+static void containerRemove(CSetContainer* c, int offset)
+{
+	int i;
+	if (NULL != c->bits)
+	{
+		if (0 != (c->bits[offset >> 6] & BIT(offset)))
+		{
+			c->bits[offset >> 6] &= ~BIT(offset);
+			c->cardinality--;
+		}
+		return;
+	}
+	i = arrayIndexOf(c, offset);
+	if (i >= 0)
+	{
+		memmove(&c->values[i], &c->values[i + 1], sizeof(*c->values) * (c->cardinality - i - 1));
+		c->cardinality--;
+	}
+}
+
+/* Smallest member >= offset, or -1 */
+static int containerNext(const CSetContainer* c, int offset)
+{
+	int i;
+	if (NULL != c->bits)
+	{
+		uint64_t w;
+		if (offset >= CSET_CHUNK_SIZE)
+		{
+			return -1;
+		}
+		i = offset >> 6;
+		w = c->bits[i] & (~(uint64_t)0 << (offset & 63));
+		while (0 == w)
+		{
+			if (++i >= CSET_BITMAP_WORDS)
+			{
+				return -1;
+			}
+			w = c->bits[i];
+		}
+		return (i << 6) + lowestBit64(w);
+	}
+	i = arrayIndexOf(c, offset);
+	if (i < 0)
+	{
+		i = -(i + 1);
+	}
+	return (i < c->cardinality) ? c->values[i] : -1;
+}
+
+static void containerWords(const CSetContainer* c, uint64_t* words)
+{
+	int i;
+	if (NULL != c->bits)
+	{
+		memcpy(words, c->bits, sizeof(*words) * CSET_BITMAP_WORDS);
+		return;
+	}
+	memset(words, 0, sizeof(*words) * CSET_BITMAP_WORDS);
+	for (i = 0; i < c->cardinality; i++)
+	{
+		words[c->values[i] >> 6] |= BIT(c->values[i]);
+	}
+}
+
+static void containerAddAll(CSetContainer* c, const CSetContainer* o, const CSetContainer* e)
+{
+	uint64_t ow[CSET_BITMAP_WORDS], ew[CSET_BITMAP_WORDS];
+	int i, cardinality = 0;
+
+	if ((NULL == c->bits) && (NULL == o->bits) && (c->cardinality + o->cardinality <= CSET_ARRAY_MAX))
+	{
+		for (i = 0; i < o->cardinality; i++)
+		{
+			if ((NULL == e) || !containerContains(e, o->values[i]))
+			{
+				containerAdd(c, o->values[i]);
+			}
+		}
+		return;
+	}
+	if (NULL == c->bits)
+	{
+		convertToBitmap(c);
+	}
+	containerWords(o, ow);
+	if (NULL != e)
+	{
+		containerWords(e, ew);
+	}
+	else
+	{
+		memset(ew, 0, sizeof(ew));
+	}
+	for (i = 0; i < CSET_BITMAP_WORDS; i++)
+	{
+		c->bits[i] |= (ow[i] & ~ew[i]);
+		cardinality += bitCount64(c->bits[i]);
+	}
+	c->cardinality = (unsigned short)cardinality;
+}
+
+static int containerContainsAll(const CSetContainer* c, const CSetContainer* o)
+{
+	int i;
+	if (o->cardinality > c->cardinality)
+	{
+		return 0;
+	}
+	if ((NULL != c->bits) && (NULL != o->bits))
+	{
+		for (i = 0; i < CSET_BITMAP_WORDS; i++) if ((c->bits[i] & o->bits[i]) != o->bits[i]) return 0;
+		return 1;
+	}
+	for (i = containerNext(o, 0); i >= 0; i = containerNext(o, i + 1))
+	{
+		if (!containerContains(c, i))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void containerRelease(CSetContainer* c)
+{
+	if (NULL != c->values)
+	{
+		myFree(c->values);
+	}
+	if (NULL != c->bits)
+	{
+		myFree(c->bits);
+	}
+}
+
+/* Index of the container for the chunk, or -(insertion point)-1 */
+static int findContainer(const compressed_set* cs, int key)
+{
+	int lo = 0, hi = cs->count - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) >> 1;
+		if (cs->containers[mid].key < key)
+		{
+			lo = mid + 1;
+		}
+		else if (cs->containers[mid].key > key)
+		{
+			hi = mid - 1;
+		}
+		else
+		{
+			return mid;
+		}
+	}
+	return -(lo + 1);
+}
+
+static CSetContainer* getContainer(const compressed_set* cs, int key)
+{
+	int i = findContainer(cs, key);
+	return (i >= 0) ? &cs->containers[i] : NULL;
+}
+
+static int getOrCreateContainer(compressed_set* cs, int key)
+{
+	int i = findContainer(cs, key);
+	if (i >= 0)
+	{
+		return i;
+	}
+	i = -(i + 1);
+	if (cs->count == cs->capacity)
+	{
+		CSetContainer* containers;
+		cs->capacity = (0 == cs->capacity) ? 1 : 2 * cs->capacity;
+		containers = myAlloc(sizeof(*containers) * cs->capacity);
+		if (NULL != cs->containers)
+		{
+			memcpy(containers, cs->containers, sizeof(*containers) * cs->count);
+			myFree(cs->containers);
+		}
+		cs->containers = containers;
+	}
+	memmove(&cs->containers[i + 1], &cs->containers[i], sizeof(*cs->containers) * (cs->count - i));
+	memset(&cs->containers[i], 0, sizeof(*cs->containers));
+	cs->containers[i].key = key;
+	cs->count++;
+	return i;
+}
+
+static void dropIfEmpty(compressed_set* cs, int i)
+{
+	if (0 != cs->containers[i].cardinality)
+	{
+		return;
+	}
+	containerRelease(&cs->containers[i]);
+	memmove(&cs->containers[i], &cs->containers[i + 1], sizeof(*cs->containers) * (cs->count - i - 1));
+	cs->count--;
+}
+
+void compressedSet_init(compressed_set* cs)
+{
+	memset(cs, 0, sizeof(*cs));
+}
+
+void compressedSet_release(compressed_set* cs)
+{
+	int i;
+	for (i = 0; i < cs->count; i++)
+	{
+		containerRelease(&cs->containers[i]);
+	}
+	if (NULL != cs->containers)
+	{
+		myFree(cs->containers);
+	}
+	memset(cs, 0, sizeof(*cs));
+}
+
+void compressedSet_add(compressed_set* cs, int n)
+{
+	int i = getOrCreateContainer(cs, CHUNK_OF(n));
+	containerAdd(&cs->containers[i], OFFSET_OF(n));
+}
+
+void compressedSet_remove(compressed_set* cs, int n)
+{
+	int i = findContainer(cs, CHUNK_OF(n));
+	if (i >= 0)
+	{
+		containerRemove(&cs->containers[i], OFFSET_OF(n));
+		dropIfEmpty(cs, i);
+	}
+}
+
+int compressedSet_contains(const compressed_set* cs, int n)
+{
+	CSetContainer* c = getContainer(cs, CHUNK_OF(n));
+	return (NULL != c) ? containerContains(c, OFFSET_OF(n)) : 0;
+}
+
+void compressedSet_addAll(compressed_set* cs, const compressed_set* o, const compressed_set* e)
+{
+	int i, j;
+	for (i = 0; i < o->count; i++)
+	{
+		const CSetContainer* oc = &o->containers[i];
+		const CSetContainer* ec = (NULL != e) ? getContainer(e, oc->key) : NULL;
+		if ((NULL != ec) && containerContainsAll(ec, oc))
+		{
+			continue;
+		}
+		j = getOrCreateContainer(cs, oc->key);
+		containerAddAll(&cs->containers[j], oc, ec);
+		dropIfEmpty(cs, j);
+	}
+}
+
+int compressedSet_containsAll(const compressed_set* cs, const compressed_set* o)
+{
+	int i;
+	for (i = 0; i < o->count; i++)
+	{
+		CSetContainer* c = getContainer(cs, o->containers[i].key);
+		if ((NULL == c) || !containerContainsAll(c, &o->containers[i]))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int compressedSet_cardinality(const compressed_set* cs)
+{
+	int i, count = 0;
+	for (i = 0; i < cs->count; i++)
+	{
+		count += cs->containers[i].cardinality;
+	}
+	return count;
+}
+
+int compressedSet_next(const compressed_set* cs, int from)
+{
+	int i = findContainer(cs, CHUNK_OF(from)), offset = OFFSET_OF(from);
+	if (i < 0)
+	{
+		i = -(i + 1);
+		offset = 0;
+	}
+	for (; i < cs->count; i++, offset = 0)
+	{
+		int r = containerNext(&cs->containers[i], offset);
+		if (r >= 0)
+		{
+			return (cs->containers[i].key << CSET_CHUNK_BITS) | r;
+		}
+	}
+	return -1;
+}
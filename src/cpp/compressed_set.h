@@ -0,0 +1,50 @@
+#ifndef __COMPRESSED_SET_H__
+#define __COMPRESSED_SET_H__
+
+#include <stdint.h>
+
+/*
+ * A roaring-style integer set: members are grouped in chunks of
+ * CSET_CHUNK_SIZE values, each kept in a container that is either a
+ * sorted array of offsets (sparse chunks) or a bitmap (dense chunks).
+ * Memory and set operations scale with the members present, not with
+ * the range they come from.
+ */
+#define CSET_CHUNK_BITS 10
+#define CSET_CHUNK_SIZE (1 << CSET_CHUNK_BITS)
+#define CSET_BITMAP_WORDS (CSET_CHUNK_SIZE / 64)
+/* An array container of this many offsets takes as much room as a bitmap */
+#define CSET_ARRAY_MAX (CSET_BITMAP_WORDS * 4)
+
+typedef struct
+{
+	int key;
+	unsigned short cardinality;
+	unsigned short capacity;
+	unsigned short* values;
+	uint64_t* bits;
+} CSetContainer;
+
+typedef struct
+{
+	CSetContainer* containers;
+	int count;
+	int capacity;
+} compressed_set;
+
+void compressedSet_init(compressed_set* cs);
+void compressedSet_release(compressed_set* cs);
+void compressedSet_add(compressed_set* cs, int n);
+void compressedSet_remove(compressed_set* cs, int n);
+int compressedSet_contains(const compressed_set* cs, int n);
+/* Adds the members of o that are not in e; e may be NULL */
+void compressedSet_addAll(compressed_set* cs, const compressed_set* o, const compressed_set* e);
+int compressedSet_containsAll(const compressed_set* cs, const compressed_set* o);
+int compressedSet_cardinality(const compressed_set* cs);
+/* Smallest member >= from, or -1 */
+int compressedSet_next(const compressed_set* cs, int from);
+
+int bitCount64(uint64_t x);
+int lowestBit64(uint64_t x);
+
+#endif
@@ -0,0 +1,394 @@
+#include "conf_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#	include <fcntl.h>
+#	include <sys/mman.h>
+#	include <unistd.h>
+#endif
+#include "agent_util.h"
+#include "allocator.h"
+
+/*
+ * The cache is the merged configuration after parsing: the ignore_classes trie and the
+ * ignore_referenced_by index as they are kept in memory, the ignore_referenced_by rules as
+ * fixed size records, and one table of the strings they refer to. Loading it is a few copies
+ * out of a mapping. It is written by and for the same build, so it's in the native layout,
+ * and it is only used while the conf files have the size and content hash recorded in it.
+ *
+ * Layout: ConfCacheHeader, sources, pattern nodes, rules, index hashes, strings.
+ */
+
+#define CONF_CACHE_MAGIC "JLKCONF"
+#define CONF_CACHE_VERSION 2
+
+typedef struct
+{
+	char magic[8];
+	unsigned int version;
+	/* guards against a cache written by a build with other structure layouts */
+	unsigned int headerSize;
+	unsigned int nodeSize;
+	unsigned int sourceCount;
+	unsigned int nodeCount;
+	unsigned int patterns;
+	unsigned int simple;
+	unsigned int ruleCount;
+	unsigned int indexCapacity;
+	unsigned int indexCount;
+	unsigned int stringsSize;
+	unsigned int reserved;
+} ConfCacheHeader;
+
+typedef struct
+{
+	ConfFileStamp stamp;
+	unsigned int path;
+	unsigned int reserved;
+} ConfCacheSource;
+
+/* one ignore_referenced_by rule, strings are offsets in the string table */
+typedef struct
+{
+	unsigned int classname;
+	unsigned int fieldName;
+	int threshold;
+} ConfCacheRule;
+
+int confCache_stampFile(const char* path, ConfFileStamp* stamp)
+{
+	FILE* f = fopen(path, "rb");
+	unsigned char buf[4096];
+	unsigned long long hash = 14695981039346656037ULL;
+	long long size = 0;
+	size_t n, i;
+	int ok;
+
+	if (NULL == f)
+	{
+		return 0;
+	}
+	/* FNV-1a */
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+	{
+		for (i = 0; i < n; i++)
+		{
+			hash = (hash ^ buf[i]) * 1099511628211ULL;
+		}
+		size += (long long)n;
+	}
+	ok = !ferror(f);
+	fclose(f);
+	stamp->size = size;
+	stamp->hash = hash;
+	return ok;
+}
+
+#ifndef WIN32
+
+typedef struct
+{
+	char* data;
+	unsigned int size;
+	unsigned int capacity;
+} StringTable;
+
+static unsigned int addString(StringTable* t, const char* s)
+{
+	unsigned int len = strlen(s) + 1, offset = t->size;
+	if (t->size + len > t->capacity)
+	{
+		unsigned int capacity = (0 == t->capacity) ? 4096 : t->capacity;
+		char* data;
+		while (t->size + len > capacity)
+		{
+			capacity *= 2;
+		}
+		data = myAlloc(capacity);
+		if (NULL != t->data)
+		{
+			memcpy(data, t->data, t->size);
+			myFree(t->data);
+		}
+		t->data = data;
+		t->capacity = capacity;
+	}
+	memcpy(t->data + t->size, s, len);
+	t->size += len;
+	return offset;
+}
+
+typedef struct
+{
+	ConfCacheRule* rules;
+	unsigned int count;
+	unsigned int capacity;
+	StringTable* strings;
+} RuleWriter;
+
+static void addClassRules(const char* classname, void* value, const void* obj)
+{
+	RuleWriter* w = (RuleWriter*)obj;
+	IgnoreField* e;
+	unsigned int classOffset;
+
+	if (NULL == value)
+	{
+		return;
+	}
+	/* each class name is kept once, whatever the number of its fields */
+	classOffset = addString(w->strings, classname);
+	for (e = (IgnoreField*)value; NULL != e; e = e->next)
+	{
+		if (w->count == w->capacity)
+		{
+			unsigned int capacity = (0 == w->capacity) ? 64 : 2 * w->capacity;
+			ConfCacheRule* rules = myAlloc(sizeof(*rules) * capacity);
+			if (NULL != w->rules)
+			{
+				memcpy(rules, w->rules, sizeof(*rules) * w->count);
+				myFree(w->rules);
+			}
+			w->rules = rules;
+			w->capacity = capacity;
+		}
+		w->rules[w->count].classname = classOffset;
+		w->rules[w->count].fieldName = addString(w->strings, e->fieldName);
+		w->rules[w->count].threshold = e->threshold;
+		w->count++;
+	}
+}
+
+static int writeAll(int fd, const void* buf, size_t size)
+{
+	const char* p = (const char*)buf;
+	while (size > 0)
+	{
+		ssize_t n = write(fd, p, size);
+		if (n <= 0)
+		{
+			return 0;
+		}
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+void confCache_save(const ConfRules* source, const char* cachePath)
+{
+	ConfCacheHeader header;
+	int count = source->conf_count;
+	ConfCacheSource* sources = myAlloc(sizeof(*sources) * count);
+	StringTable strings;
+	RuleWriter rules;
+	ClassPatterns* patterns = source->ignore_classes;
+	NameIndex* index = source->ignore_referenced_by_index;
+	char tmpPath[FILENAME_MAX];
+	int i, fd, ok;
+
+	memset(&strings, 0, sizeof(strings));
+	memset(&rules, 0, sizeof(rules));
+	rules.strings = &strings;
+	for (i = 0; i < count; i++)
+	{
+		/* as stamped before parsing, so a change made meanwhile invalidates the cache */
+		sources[i].stamp = source->conf_stamps[i];
+		sources[i].path = addString(&strings, source->conf_paths[i]);
+		sources[i].reserved = 0;
+	}
+	sm_enum(source->ignore_referenced_by, addClassRules, &rules);
+
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, CONF_CACHE_MAGIC);
+	header.version = CONF_CACHE_VERSION;
+	header.headerSize = sizeof(header);
+	header.nodeSize = sizeof(ClassPatternNode);
+	header.sourceCount = count;
+	header.nodeCount = patterns->count;
+	header.patterns = patterns->patterns;
+	header.simple = patterns->simple;
+	header.ruleCount = rules.count;
+	header.indexCapacity = index->capacity;
+	header.indexCount = index->count;
+	header.stringsSize = strings.size;
+
+	/* written aside and renamed, so a concurrent attach never maps a partial cache */
+	ok = (snprintf(tmpPath, sizeof(tmpPath), "%s.%d", cachePath, (int)getpid()) < (int)sizeof(tmpPath));
+	fd = ok ? open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	if (fd >= 0)
+	{
+		ok = writeAll(fd, &header, sizeof(header)) &&
+			writeAll(fd, sources, sizeof(*sources) * count) &&
+			writeAll(fd, patterns->nodes, sizeof(*patterns->nodes) * patterns->count) &&
+			writeAll(fd, rules.rules, sizeof(*rules.rules) * rules.count) &&
+			writeAll(fd, index->hashes, sizeof(*index->hashes) * index->capacity) &&
+			writeAll(fd, strings.data, strings.size);
+		ok = (0 == close(fd)) && ok && (0 == rename(tmpPath, cachePath));
+		if (!ok)
+		{
+			unlink(tmpPath);
+		}
+	}
+	if ((fd < 0) || !ok)
+	{
+		alert("jleaker: Can't write the configuration cache %s\n", cachePath);
+	}
+	else
+	{
+		debug("jleaker: Wrote the configuration cache %s\n", cachePath);
+	}
+	myFree(sources);
+	if (NULL != rules.rules)
+	{
+		myFree(rules.rules);
+	}
+	if (NULL != strings.data)
+	{
+		myFree(strings.data);
+	}
+}
+
+static int isCacheCurrent(const ConfCacheHeader* header, size_t fileSize, const ConfRules* target)
+{
+	const ConfCacheSource* sources = (const ConfCacheSource*)(header + 1);
+	const char* strings;
+	size_t size;
+	int i;
+
+	if ((fileSize < sizeof(*header)) || (0 != memcmp(header->magic, CONF_CACHE_MAGIC, sizeof(CONF_CACHE_MAGIC))) ||
+			(CONF_CACHE_VERSION != header->version) || (sizeof(*header) != header->headerSize) ||
+			(sizeof(ClassPatternNode) != header->nodeSize) || ((unsigned int)target->conf_count != header->sourceCount))
+	{
+		return 0;
+	}
+	size = sizeof(*header) + sizeof(ConfCacheSource) * (size_t)header->sourceCount +
+			sizeof(ClassPatternNode) * (size_t)header->nodeCount + sizeof(ConfCacheRule) * (size_t)header->ruleCount +
+			sizeof(unsigned int) * (size_t)header->indexCapacity + header->stringsSize;
+	if ((size != fileSize) || (0 == header->stringsSize) || (0 == header->nodeCount) ||
+			(0 == header->indexCapacity) || (0 != (header->indexCapacity & (header->indexCapacity - 1))))
+	{
+		return 0;
+	}
+	strings = (const char*)header + size - header->stringsSize;
+	if ('\0' != strings[header->stringsSize - 1])
+	{
+		return 0;
+	}
+	for (i = 0; i < target->conf_count; i++)
+	{
+		if ((sources[i].path >= header->stringsSize) || (0 != strcmp(strings + sources[i].path, target->conf_paths[i])) ||
+				(target->conf_stamps[i].size != sources[i].stamp.size) || (target->conf_stamps[i].hash != sources[i].stamp.hash))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether every rule refers to strings of the table */
+static int areRulesValid(const ConfCacheRule* rules, unsigned int count, unsigned int stringsSize)
+{
+	unsigned int i;
+	for (i = 0; i < count; i++)
+	{
+		if ((rules[i].classname >= stringsSize) || (rules[i].fieldName >= stringsSize))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void loadRules(ConfRules* target, const ConfCacheRule* rules, unsigned int count, const char* strings)
+{
+	unsigned int i;
+	IgnoreField* last = NULL;
+
+	for (i = 0; i < count; i++)
+	{
+		IgnoreField* e = (IgnoreField*)myAlloc(sizeof(*e));
+		memset(e, 0, sizeof(*e));
+		e->fieldName = myStrdup(strings + rules[i].fieldName);
+		e->threshold = rules[i].threshold;
+		/* rules of a class are consecutive, and keep their order */
+		if ((NULL != last) && (rules[i - 1].classname == rules[i].classname))
+		{
+			last->next = e;
+		}
+		else
+		{
+			sm_put(target->ignore_referenced_by, strings + rules[i].classname, e);
+		}
+		last = e;
+	}
+}
+
+int confCache_load(ConfRules* target, const char* cachePath)
+{
+	struct stat st;
+	const ConfCacheHeader* header;
+	const ClassPatternNode* nodes;
+	const ConfCacheRule* rules;
+	const unsigned int* hashes;
+	NameIndex* index;
+	void* p;
+	int fd, res = 0;
+
+	fd = open(cachePath, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	if ((0 != fstat(fd, &st)) || ((size_t)st.st_size < sizeof(ConfCacheHeader)))
+	{
+		close(fd);
+		return 0;
+	}
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == p)
+	{
+		return 0;
+	}
+	header = (const ConfCacheHeader*)p;
+	if (isCacheCurrent(header, (size_t)st.st_size, target))
+	{
+		nodes = (const ClassPatternNode*)((const ConfCacheSource*)(header + 1) + header->sourceCount);
+		rules = (const ConfCacheRule*)(nodes + header->nodeCount);
+		hashes = (const unsigned int*)(rules + header->ruleCount);
+		/* all checked before the target is touched, so a damaged cache falls back to parsing, which rewrites it */
+		index = areRulesValid(rules, header->ruleCount, header->stringsSize) ?
+				nameIndex_load(hashes, header->indexCapacity, header->indexCount) : NULL;
+		if ((NULL != index) && classPatterns_load(target->ignore_classes, nodes, header->nodeCount, header->patterns, header->simple))
+		{
+			target->ignore_referenced_by_index = index;
+			loadRules(target, rules, header->ruleCount, (const char*)(hashes + header->indexCapacity));
+			debug("jleaker: Loaded %u ignore_classes trie nodes and %u ignore_referenced_by rules from %s\n",
+					header->nodeCount, header->ruleCount, cachePath);
+			res = 1;
+		}
+		else
+		{
+			nameIndex_free(&index);
+			alert("jleaker: The configuration cache %s is damaged, parsing the configuration files\n", cachePath);
+		}
+	}
+	munmap(p, (size_t)st.st_size);
+	return res;
+}
+
+#else
+
+void confCache_save(__UNUSED__ const ConfRules* source, __UNUSED__ const char* cachePath)
+{
+}
+
+int confCache_load(__UNUSED__ ConfRules* target, __UNUSED__ const char* cachePath)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef __CONF_CACHE_H__
+#define __CONF_CACHE_H__
+
+#include "data_struct.h"
+
+/* Fingerprints a conf file by its size and a hash of its content. Timestamps aren't enough: a
+ * same size edit within a second, or a copy that keeps the original time, leaves them as they were. */
+int confCache_stampFile(const char* path, ConfFileStamp* stamp);
+/* Loads the rules compiled from the target's conf files into the (empty) target rules, if the
+ * cache was written from the same files with the same stamps. Returns 0 if the files must be parsed. */
+int confCache_load(ConfRules* target, const char* cachePath);
+/* Writes the rules, as parsed from their conf files */
+void confCache_save(const ConfRules* source, const char* cachePath);
+
+#endif
@@ -1,133 +1,469 @@
 #include "data_struct.h"
 #include "agent_util.h"
 #include "allocator.h"
+#include "jvm_reference.h"
+#include <stdint.h>
+#include <limits.h>
 
 extern GlobalData* gdata;
 static ThreadData tdata;
 
-MemoryNode* newMemoryNode()
+NodeId newMemoryNode()
 {
-	MemoryNode* n = (MemoryNode*)myAlloc(sizeof(*n));
-	tdata.nodes_allocated++;
-    (void)memset(n, 0, sizeof(*n));
-    n->leaks_related = bitMaskSet_new(gdata->numberOfLeaks);
-	n->reference_pointing_to_me++;
-    return n;
+	NodeStore* store = &tdata.nodes;
+	NodeChunk* chunk;
+	NodeId id;
+	unsigned int chunkIdx;
+
+	if (NO_NODE == store->next)
+	{
+		store->next = 1;
+	}
+	id = store->next++;
+	chunkIdx = id >> NODE_CHUNK_BITS;
+	if (chunkIdx >= store->chunks_capacity)
+	{
+		unsigned int capacity = (0 == store->chunks_capacity) ? 16 : 2 * store->chunks_capacity;
+		NodeChunk** chunks = myAlloc(sizeof(*chunks) * capacity);
+		memset(chunks, 0, sizeof(*chunks) * capacity);
+		if (NULL != store->chunks)
+		{
+			memcpy(chunks, store->chunks, sizeof(*chunks) * store->chunks_capacity);
+			myFree(store->chunks);
+		}
+		store->chunks = chunks;
+		store->chunks_capacity = capacity;
+	}
+	chunk = store->chunks[chunkIdx];
+	if (NULL == chunk)
+	{
+		chunk = (NodeChunk*)arenaAlloc(&tdata.graphArena, sizeof(*chunk));
+		(void)memset(chunk, 0, sizeof(*chunk));
+		store->chunks[chunkIdx] = chunk;
+	}
+    if (gdata->compressed_sets)
+    {
+    	bitMaskSet_initCompressed(&NODE_FIELD(store, id, leaks_related), gdata->numberOfLeaks);
+    }
+    else
+    {
+    	bitMaskSet_initInArena(&NODE_FIELD(store, id, leaks_related), &tdata.graphArena, gdata->numberOfLeaks);
+    }
+    return id;
 }
 
-jboolean freeMemoryNode(MemoryNode* node)
+MemoryNode* getMemoryNode(NodeId id)
 {
-	MemoryReferer* ref;
-	ClassReferenceCount* fan_in_ptr;
-	JNIEnv* env = getThreadData()->jni;
-
-	if (NULL == node)
+	MemoryNode** cold = &NODE_FIELD(&tdata.nodes, id, cold);
+	if (NULL == *cold)
 	{
-		return JNI_FALSE;
+		*cold = (MemoryNode*)arenaAlloc(&tdata.graphArena, sizeof(**cold));
+		(void)memset(*cold, 0, sizeof(**cold));
 	}
-	node->reference_pointing_to_me--;
-	if (node->visited != JNI_FALSE)
+	return *cold;
+}
+
+/* Releases what the nodes hold outside the graph arena, then the arena itself */
+void releaseAllMemoryNodes()
+{
+	JNIEnv* env = tdata.jni;
+	NodeStore* store = &tdata.nodes;
+	NodeId id;
+
+	for (id = 1; id < store->next; id++)
 	{
-		return JNI_FALSE;
+		MemoryNode* node = NODE_FIELD(store, id, cold);
+		bitMaskSet_release(&NODE_FIELD(store, id, leaks_related));
+		if (NULL == node)
+		{
+			continue;
+		}
+		if (NULL != node->classname)
+		{
+			myFree(node->classname);
+		}
+		if (NULL != node->klass)
+		{
+			(*env)->DeleteLocalRef(env, node->klass);
+		}
+		if (NULL != node->obj)
+		{
+			(*env)->DeleteLocalRef(env, node->obj);
+		}
+		while (NULL != node->ignore_fields)
+		{
+			IgnoreField* ignoreField = node->ignore_fields->next;
+			myFree(node->ignore_fields->fieldName);
+			myFree(node->ignore_fields);
+			node->ignore_fields = ignoreField;
+		}
+		freeFieldNameTable(&node->field_names);
 	}
-	node->visited = JNI_TRUE;
-	if (NULL != node->classname)
+	debug("Released %d graph nodes, %ld bytes of graph memory\n", (0 == store->next) ? 0 : (int)(store->next - 1), (long)tdata.graphArena.allocated);
+	if (NULL != store->chunks)
 	{
-		myFree(node->classname);
-		node->classname = NULL;
+		myFree(store->chunks);
 	}
-	if (NULL != node->klass)
+	memset(store, 0, sizeof(*store));
+	if (NULL != tdata.edges.edges)
 	{
-		(*env)->DeleteLocalRef(env, node->klass);
-		node->klass = NULL;
+		myFree(tdata.edges.edges);
 	}
-	if (NULL != node->obj)
+	memset(&tdata.edges, 0, sizeof(tdata.edges));
+	if (NULL != tdata.rootDetails.details)
 	{
-		(*env)->DeleteLocalRef(env, node->obj);
-		node->obj = NULL;
+		myFree(tdata.rootDetails.details);
 	}
-	while (NULL != node->ignore_fields)
+	memset(&tdata.rootDetails, 0, sizeof(tdata.rootDetails));
+	memset(&tdata.edgeIndex, 0, sizeof(tdata.edgeIndex));
+	arenaRelease(&tdata.refererArena);
+	arenaRelease(&tdata.graphArena);
+}
+
+#define EDGE_SET_INITIAL_CAPACITY 1024
+
+static jint referenceIndex(jvmtiHeapReferenceKind reference_kind, const jvmtiHeapReferenceInfo* reference_info)
+{
+	if (NULL == reference_info)
 	{
-		IgnoreField* ignoreField = node->ignore_fields->next;
-		myFree(node->ignore_fields->fieldName);
-		myFree(node->ignore_fields);
-		node->ignore_fields = ignoreField;
+		return 0;
 	}
-	bitMaskSet_free(&node->leaks_related);
-	ref = node->start;
-	while (NULL != ref)
+	switch (reference_kind)
 	{
-		MemoryReferer* next = ref->next;
-		freeMemoryNode(ref->node);
-		myFree(ref);
-		ref = next;
+	case JVMTI_HEAP_REFERENCE_FIELD:
+	case JVMTI_HEAP_REFERENCE_STATIC_FIELD:
+		return reference_info->field.index;
+	case JVMTI_HEAP_REFERENCE_ARRAY_ELEMENT:
+		return reference_info->array.index;
+	case JVMTI_HEAP_REFERENCE_CONSTANT_POOL:
+		return reference_info->constant_pool.index;
+	default:
+		return 0;
 	}
-	node->start = node->last = NULL;
+}
+
+static unsigned int hashEdge(const ReferenceEdge* e)
+{
+	uint64_t h = ((uint64_t)e->node << 32 | e->referrer) * 0x9E3779B97F4A7C15ULL;
+	h ^= ((uint64_t)(unsigned int)e->index << 8) ^ (uint64_t)(unsigned int)e->kind;
+	h *= 0x165667B19E3779F9ULL;
+	return (unsigned int)(h >> 32);
+}
 
-	fan_in_ptr = node->fan_in;
-	while (NULL != fan_in_ptr)
+static ReferenceEdge* findEdgeSlot(ReferenceEdge* edges, unsigned int capacity, const ReferenceEdge* e)
+{
+	unsigned int mask = capacity - 1;
+	unsigned int i = hashEdge(e) & mask;
+	while (NO_NODE != edges[i].node)
 	{
-		ClassReferenceCount* next = fan_in_ptr->next;
-		myFree(fan_in_ptr);
-		fan_in_ptr = next;
+		if ((edges[i].node == e->node) && (edges[i].referrer == e->referrer) &&
+				(edges[i].kind == e->kind) && (edges[i].index == e->index))
+		{
+			break;
+		}
+		i = (i + 1) & mask;
 	}
-	node->fan_in = NULL;
+	return &edges[i];
+}
 
-	if (0 < node->reference_pointing_to_me)
+/* Returns JNI_FALSE if the table is already as large as a myAlloc block can be */
+static jboolean growEdgeSet(EdgeSet* set)
+{
+	unsigned int oldCapacity = set->capacity, i;
+	ReferenceEdge* old = set->edges;
+
+	if ((0 != oldCapacity) && (oldCapacity > INT_MAX / 2 / sizeof(*set->edges)))
 	{
-		node->visited = JNI_FALSE;
 		return JNI_FALSE;
 	}
-	tdata.nodes_freed++;
-	myFree(node);
+	set->capacity = (0 == oldCapacity) ? EDGE_SET_INITIAL_CAPACITY : 2 * oldCapacity;
+	set->edges = myAlloc(sizeof(*set->edges) * set->capacity);
+	memset(set->edges, 0, sizeof(*set->edges) * set->capacity);
+	for (i = 0; i < oldCapacity; i++)
+	{
+		if (NO_NODE != old[i].node)
+		{
+			*findEdgeSlot(set->edges, set->capacity, &old[i]) = old[i];
+		}
+	}
+	if (NULL != old)
+	{
+		myFree(old);
+	}
 	return JNI_TRUE;
 }
 
-jboolean hasReferenceBetweenObjects(MemoryNode* n1, MemoryNode* n2,
+/* Records the reference from referrer to node. Returns JNI_FALSE if it was already recorded. */
+jboolean registerReferenceEdge(NodeId node, NodeId referrer,
 		jvmtiHeapReferenceKind reference_kind, const jvmtiHeapReferenceInfo* reference_info)
 {
-	MemoryReferer* ref = n1->start;
-	while (NULL != ref)
+	EdgeSet* set = &tdata.edges;
+	ReferenceEdge e, *slot;
+
+	e.node = node;
+	e.referrer = referrer;
+	e.kind = reference_kind;
+	e.index = referenceIndex(reference_kind, reference_info);
+	if ((2 * (set->count + 1) > set->capacity) && !growEdgeSet(set))
 	{
-		if (ref->kind == reference_kind)
+		/* the table is full: keep dropping the duplicates of what it holds, record the rest unchecked */
+		if (!set->full)
 		{
-			if ((NULL == reference_info) || (0 == memcmp(reference_info, &ref->info, sizeof(ref->info))))
+			alert("jleaker: More than %u distinct references, duplicate references may be recorded\n", set->count);
+			set->full = JNI_TRUE;
+		}
+		return (NO_NODE == findEdgeSlot(set->edges, set->capacity, &e)->node) ? JNI_TRUE : JNI_FALSE;
+	}
+	slot = findEdgeSlot(set->edges, set->capacity, &e);
+	if (NO_NODE != slot->node)
+	{
+		return JNI_FALSE;
+	}
+	*slot = e;
+	set->count++;
+	return JNI_TRUE;
+}
+
+void setEdgeInfo(GraphEdge* edge, jvmtiHeapReferenceKind reference_kind, const jvmtiHeapReferenceInfo* reference_info)
+{
+	RootDetailTable* table = &tdata.rootDetails;
+
+	edge->kind = (unsigned char)reference_kind;
+	if ((NULL == reference_info) ||
+			((JVMTI_HEAP_REFERENCE_STACK_LOCAL != reference_kind) && (JVMTI_HEAP_REFERENCE_JNI_LOCAL != reference_kind)))
+	{
+		edge->index = referenceIndex(reference_kind, reference_info);
+		return;
+	}
+	if (table->count == table->capacity)
+	{
+		jint capacity = (0 == table->capacity) ? 64 : 2 * table->capacity;
+		jvmtiHeapReferenceInfo* details = myAlloc(sizeof(*details) * capacity);
+		if (NULL != table->details)
+		{
+			memcpy(details, table->details, sizeof(*details) * table->count);
+			myFree(table->details);
+		}
+		table->details = details;
+		table->capacity = capacity;
+	}
+	table->details[table->count] = *reference_info;
+	edge->index = table->count++;
+}
+
+/* The full details of a stack or JNI local root reference */
+const jvmtiHeapReferenceInfo* getRootDetails(const GraphEdge* edge)
+{
+	if ((JVMTI_HEAP_REFERENCE_STACK_LOCAL != edge->kind) && (JVMTI_HEAP_REFERENCE_JNI_LOCAL != edge->kind))
+	{
+		fatal_error("Reference of kind %d has no root details\n", (int)edge->kind);
+	}
+	return &tdata.rootDetails.details[edge->index];
+}
+
+/* Whether an arena block of the given size can be taken for the compacted graph: arenaAlloc
+ * sizes are ints, and the block must fit in what is left of the memory budget */
+static jboolean fitsCompactGraph(size_t size)
+{
+	size_t budget = (size_t)gdata->max_agent_memory_mb << 20;
+
+	if (size > INT_MAX)
+	{
+		return JNI_FALSE;
+	}
+	/* a scratch file isn't memory the agent holds */
+	return ((0 == budget) || tdata.graphArena.mapped || (getAllocatorBytesInUse() + size <= budget)) ? JNI_TRUE : JNI_FALSE;
+}
+
+/* The capture prepends each reference to its node's list, so no tail has to be kept per node.
+ * Turns the lists back into the order the heap walk reported them. */
+void orderReferenceLists()
+{
+	NodeStore* store = &tdata.nodes;
+	NodeId id;
+
+	for (id = 1; id < store->next; id++)
+	{
+		MemoryReferer* ref = NODE_FIELD(store, id, first_edge);
+		MemoryReferer* ordered = NULL;
+		while (NULL != ref)
+		{
+			MemoryReferer* next = ref->next;
+			ref->next = ordered;
+			ordered = ref;
+			ref = next;
+		}
+		NODE_FIELD(store, id, first_edge) = ordered;
+	}
+}
+
+/* Packs the captured reference lists into one array, ordered by node, so the traversals
+ * after the capture read the references sequentially. The lists are released afterwards,
+ * so the graph ends up 12 bytes per reference smaller, but while the array is filled both
+ * forms are held. If that doesn't fit, the lists are kept and put in order. */
+void compactReferenceGraph()
+{
+	NodeStore* store = &tdata.nodes;
+	EdgeIndex* index = &tdata.edgeIndex;
+	unsigned int* offsets;
+	GraphEdge* edges;
+	size_t total = 0;
+	NodeId id;
+
+	if (NO_NODE == store->next)
+	{
+		return;
+	}
+	if (!fitsCompactGraph(sizeof(*offsets) * ((size_t)store->next + 1)))
+	{
+		alert("jleaker: Not enough memory to compact the reference graph\n");
+		orderReferenceLists();
+		return;
+	}
+	offsets = arenaAlloc(&tdata.graphArena, sizeof(*offsets) * (store->next + 1));
+	offsets[0] = 0;
+	offsets[1] = 0;
+	for (id = 1; id < store->next; id++)
+	{
+		MemoryReferer* ref;
+		for (ref = NODE_FIELD(store, id, first_edge); NULL != ref; ref = ref->next)
+		{
+			total++;
+		}
+		offsets[id + 1] = (unsigned int)total;
+	}
+	if ((total > UINT_MAX) || !fitsCompactGraph(sizeof(*edges) * (total + 1)))
+	{
+		alert("jleaker: Not enough memory to compact the %lu references of the reference graph\n", (unsigned long)total);
+		orderReferenceLists();
+		return;
+	}
+	edges = arenaAlloc(&tdata.graphArena, (int)(sizeof(*edges) * (total + 1)));
+	for (id = 1; id < store->next; id++)
+	{
+		MemoryReferer* ref;
+		/* the lists are newest first, fill the node's slice from its end */
+		GraphEdge* edge = &edges[offsets[id + 1]];
+		for (ref = NODE_FIELD(store, id, first_edge); NULL != ref; ref = ref->next)
+		{
+			*--edge = ref->edge;
+		}
+		NODE_FIELD(store, id, first_edge) = NULL;
+	}
+	index->offsets = offsets;
+	index->edges = edges;
+	debug("Compacted %lu references of %u nodes, releasing %ld bytes of reference lists\n",
+			(unsigned long)total, store->next - 1, (long)tdata.refererArena.allocated);
+	arenaRelease(&tdata.refererArena);
+}
+
+void edgeIterator_init(EdgeIterator* it, NodeId node)
+{
+	EdgeIndex* index = &tdata.edgeIndex;
+	if (NULL != index->offsets)
+	{
+		it->referer = NULL;
+		it->edge = &index->edges[index->offsets[node]];
+		it->end = &index->edges[index->offsets[node + 1]];
+	}
+	else
+	{
+		it->referer = NODE_FIELD(&tdata.nodes, node, first_edge);
+		it->edge = NULL;
+		it->end = NULL;
+	}
+}
+
+const GraphEdge* edgeIterator_next(EdgeIterator* it)
+{
+	if (NULL != it->referer)
+	{
+		MemoryReferer* ref = it->referer;
+		it->referer = ref->next;
+		return &ref->edge;
+	}
+	if (it->edge < it->end)
+	{
+		return it->edge++;
+	}
+	return NULL;
+}
+
+#define FAN_IN_OVERFLOW_INITIAL_CAPACITY 8
+
+static ClassReferenceCount* findFanInSlot(FanInOverflow* table, NodeId classNode)
+{
+	unsigned int mask = table->capacity - 1;
+	unsigned int i = (classNode * 0x9E3779B1U) & mask;
+	while ((NO_NODE != table->slots[i].classNode) && (table->slots[i].classNode != classNode))
+	{
+		i = (i + 1) & mask;
+	}
+	return &table->slots[i];
+}
+
+/* Tables live in the graph arena: the outgrown one is simply abandoned until the dump is released */
+static FanInOverflow* newFanInOverflow(FanInOverflow* old)
+{
+	unsigned int capacity = (NULL == old) ? FAN_IN_OVERFLOW_INITIAL_CAPACITY : 2 * old->capacity;
+	size_t size = sizeof(FanInOverflow) + (capacity - 1) * sizeof(ClassReferenceCount);
+	FanInOverflow* table = (FanInOverflow*)arenaAlloc(&tdata.graphArena, size);
+	unsigned int i;
+
+	memset(table, 0, size);
+	table->capacity = capacity;
+	if (NULL != old)
+	{
+		for (i = 0; i < old->capacity; i++)
+		{
+			if (NO_NODE != old->slots[i].classNode)
 			{
-				if (ref->node == n2)
-				{
-					return JNI_TRUE;
-				}
+				*findFanInSlot(table, old->slots[i].classNode) = old->slots[i];
 			}
 		}
-		ref = ref->next;
+		table->count = old->count;
 	}
-	return JNI_FALSE;
+	return table;
 }
 
-int addReferenceClass(MemoryNode* node, MemoryNode* classNode)
+int addReferenceClass(NodeId node, NodeId classNode)
 {
-	jclass theClass;
-	ClassReferenceCount* rCount, **last;
-	if (!classNode->classNode)
+	FanInTable* fanIn = &NODE_FIELD(&tdata.nodes, node, fan_in);
+	ClassReferenceCount* rCount;
+	int i;
+	if (0 == (NODE_FIELD(&tdata.nodes, classNode, flags) & NODE_FLAG_CLASS))
 	{
-		fatal_error("Node %p is not a class node\n", classNode);
+		fatal_error("Node %u is not a class node\n", classNode);
 	}
-	theClass = (jclass)classNode->obj;
-	last = &node->fan_in;
-	rCount = *last;
-	while (NULL != rCount)
+	for (i = 0; i < FAN_IN_INLINE_SLOTS; i++)
 	{
-		if (rCount->klass == theClass)
+		rCount = &fanIn->inline_slots[i];
+		if (rCount->classNode == classNode)
+		{
+			return ++rCount->count;
+		}
+		if (NO_NODE == rCount->classNode)
 		{
+			rCount->classNode = classNode;
 			return ++rCount->count;
 		}
-		last = &rCount->next;
-		rCount = rCount->next;
 	}
-	*last = (ClassReferenceCount*)myAlloc(sizeof(**last));
-	memset(*last, 0, sizeof(**last));
-	(*last)->klass = theClass;
-	return ++(*last)->count;
+	if (NULL == fanIn->overflow)
+	{
+		fanIn->overflow = newFanInOverflow(NULL);
+	}
+	rCount = findFanInSlot(fanIn->overflow, classNode);
+	if (NO_NODE == rCount->classNode)
+	{
+		if (2 * (fanIn->overflow->count + 1) > fanIn->overflow->capacity)
+		{
+			fanIn->overflow = newFanInOverflow(fanIn->overflow);
+			rCount = findFanInSlot(fanIn->overflow, classNode);
+		}
+		rCount->classNode = classNode;
+		fanIn->overflow->count++;
+	}
+	return ++rCount->count;
 }
 
 void freeMemoryForLeakList(LeakingNodes* lstLeaks)
@@ -137,7 +473,6 @@ void freeMemoryForLeakList(LeakingNodes* lstLeaks)
 	while (NULL != leak)
 	{
 		LeakingNodes* next = leak->next;
-		freeMemoryNode(leak->node);
 		myFree(leak);
 		leak = next;
 	}
@@ -145,19 +480,42 @@ void freeMemoryForLeakList(LeakingNodes* lstLeaks)
 
 void initThreadData(JNIEnv* env)
 {
-	jclass objectClass;
 	jclass threadClass;
 	jmethodID metCurrentThread, metGetThreadID;
 	jobject thisThread;
 	int i;
 
 	memset(&tdata, 0, sizeof(tdata));
+	arenaInit(&tdata.graphArena);
+	if (('\0' != gdata->scratch_dir[0]) && !arenaInitMapped(&tdata.graphArena, gdata->scratch_dir))
+	{
+		alert("jleaker: Can't create a scratch file in %s, keeping the reference graph in memory\n", gdata->scratch_dir);
+	}
+	if (gdata->huge_pages)
+	{
+		if (tdata.graphArena.mapped)
+		{
+			alert("jleaker: huge_pages doesn't apply to a reference graph kept in a scratch file\n");
+		}
+		else
+		{
+			arenaUseHugePages(&tdata.graphArena);
+		}
+	}
+	/* the reference lists go where the rest of the graph goes */
+	arenaInit(&tdata.refererArena);
+	if (tdata.graphArena.mapped && !arenaInitMapped(&tdata.refererArena, gdata->scratch_dir))
+	{
+		alert("jleaker: Can't create a scratch file in %s, keeping the reference lists in memory\n", gdata->scratch_dir);
+	}
+	if (tdata.graphArena.hugePages)
+	{
+		arenaUseHugePages(&tdata.refererArena);
+	}
 	tdata.jni = env;
 	tdata.outputStream.type = OUTPUT_TYPE_FILE;
 	tdata.outputStream.handle.file = stdout;
     tdata.classClass = (*env)->FindClass(env, "java/lang/Class");
-    objectClass = (*env)->FindClass(env, "java/lang/Object");
-    tdata.metEquals = (*env)->GetMethodID(env, objectClass, "equals", "(Ljava/lang/Object;)Z");
 
     tdata.sizeableClasses = myAlloc(sizeof(*tdata.sizeableClasses)*gdata->sizeableClassesNum);
     for (i = 0; i < gdata->sizeableClassesNum; i++)
@@ -170,9 +528,7 @@ void initThreadData(JNIEnv* env)
     metGetThreadID = (*env)->GetMethodID(env, threadClass, "getId", "()J");
     thisThread = (*env)->CallStaticObjectMethod(env, threadClass, metCurrentThread);
     tdata.thread_id = (*env)->CallLongMethod(env, thisThread, metGetThreadID);
-	tdata.metGetClassName = (*env)->GetMethodID(env, tdata.classClass, "getCanonicalName", "()Ljava/lang/String;");
 
-    (*env)->DeleteLocalRef(env, objectClass);
     (*env)->DeleteLocalRef(env, threadClass);
     (*env)->DeleteLocalRef(env, thisThread);
 }
@@ -191,16 +547,15 @@ void releaseThreadData()
     		(*env)->DeleteLocalRef(env, klass);
     	}
     }
-    sm_delete(gdata->ignore_classes);
-    sm_delete(gdata->ignore_referenced_by);
-    gdata->ignore_classes = NULL;
-    gdata->ignore_referenced_by = NULL;
     myFree(tdata.sizeableClasses);
 
-	if (tdata.nodes_allocated != tdata.nodes_freed)
+	if (NO_NODE != tdata.nodes.next)
 	{
-		alert("DETECTED INTERNAL LEAK: nodes allocated: %d, nodes freed: %d\n", tdata.nodes_allocated, tdata.nodes_freed);
+		alert("DETECTED INTERNAL LEAK: %d graph nodes were not released\n", (int)(tdata.nodes.next - 1));
+		releaseAllMemoryNodes();
 	}
+	arenaClose(&tdata.refererArena);
+	arenaClose(&tdata.graphArena);
 	memset(&tdata, 0, sizeof(tdata));
 }
 
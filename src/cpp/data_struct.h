@@ -3,6 +3,8 @@
 
 #include "bitmask_set.h"
 #include "strmap.h"
+#include "name_index.h"
+#include "class_pattern.h"
 #include <jvmti.h>
 #ifdef WIN32
 #	include <WinSock2.h>
@@ -10,6 +12,9 @@
 
 typedef void (*object_print_function)(jobject);
 
+/* The supertype closure of a class keeps one bit per sizeable class */
+#define MAX_SIZEABLE_CLASSES 32
+
 typedef struct
 {
 	jlong startTime;
@@ -22,6 +27,25 @@ typedef struct
 	object_print_function print_fn;
 } SizeableClassDescriptor;
 
+typedef struct
+{
+	long long size;
+	unsigned long long hash;
+} ConfFileStamp;
+
+/* The rules read from the conf files. They are kept across dumps, and replaced as a whole
+ * between dumps when the conf files change or a reload is asked for. */
+typedef struct
+{
+    ClassPatterns *ignore_classes;
+    StrMap *ignore_referenced_by;
+    NameIndex *ignore_referenced_by_index;
+    /* the conf files they were read from, and their size and content hash then */
+    int conf_count;
+    char** conf_paths;
+    ConfFileStamp* conf_stamps;
+} ConfRules;
+
 /* Global static data */
 typedef struct
 {
@@ -30,8 +54,11 @@ typedef struct
     jboolean      dumpInProgress;
     jboolean run_gc;
     jboolean show_unreachables;
-    StrMap *ignore_classes;
-    StrMap *ignore_referenced_by;
+    /* the rules the dumps use, only replaced by the dumper thread before it starts a dump */
+    ConfRules *rules;
+    /* rules loaded by an attach, taken by the next dump; guarded by lock */
+    ConfRules *pending_rules;
+    jboolean reload_conf;
     jrawMonitorID lock;
     jvmtiEnv *jvmti;
     JavaVM *vm;
@@ -46,6 +73,16 @@ typedef struct
     int debug;
     int consider_local_references;
     int self_check;
+    jboolean resident;
+    jboolean compressed_sets;
+    jboolean compact_graph;
+    jboolean allocation_sites;
+    jboolean huge_pages;
+    int max_agent_memory_mb;
+    /* where the graph is spilled to, empty to keep it in memory */
+    char scratch_dir[FILENAME_MAX];
+    /* where the parsed conf files are cached, empty for no cache */
+    char conf_cache[FILENAME_MAX];
 } GlobalData;
 
 typedef struct
@@ -53,6 +90,14 @@ typedef struct
 	jclass klass;
 } SizeableClassThreadData;
 
+/* What is needed to classify a class, either through local references of the dumper
+ * thread or through global references held by the resident classifier */
+typedef struct
+{
+	jclass classClass;
+	SizeableClassThreadData* sizeableClasses;
+} ClassClassifier;
+
 typedef struct
 {
 	jobject* obj_ptr;
@@ -61,21 +106,81 @@ typedef struct
 	jmethodID *sizeMethods;
 } LeakCheckData;
 
+/* Graph nodes are identified by a dense id; 0 is never a node */
+typedef unsigned int NodeId;
+#define NO_NODE 0U
+
+/* A node's tag is its id with a marker bit, so it can't be confused with the class marking tags */
+#define NODE_TAG_MARKER ((jlong)1 << 48)
+#define NODE_TAG(id) (NODE_TAG_MARKER | (jlong)(id))
+#define IS_NODE_TAG(tag) (0 != ((tag) & NODE_TAG_MARKER))
+#define NODE_ID_OF_TAG(tag) ((NodeId)((tag) & 0xFFFFFFFF))
+
+/*
+ * A reference to a node, keeping only the payload its kind needs: the field, array or
+ * constant pool index. Stack and JNI local roots keep their full details in the thread's
+ * RootDetailTable, and index is their slot there.
+ */
+typedef struct
+{
+	NodeId node;
+	jint index;
+	unsigned char kind;
+} GraphEdge;
+
+/* The references to a node as captured, in the order they were reported */
 typedef struct _MemoryReferer
 {
-	jvmtiHeapReferenceKind kind;
-    jvmtiHeapReferenceInfo info;
-    struct _MemoryNode *node;
 	struct _MemoryReferer* next;
+	GraphEdge edge;
 } MemoryReferer;
 
-typedef struct _ClassReferenceCount
+/* Compressed sparse row form of the references, built after capture when compact_graph is on:
+ * the references to node id are edges[offsets[id]] up to edges[offsets[id + 1]] */
+typedef struct
 {
-	jclass klass;
+	unsigned int* offsets;
+	GraphEdge* edges;
+} EdgeIndex;
+
+/* Walks the references to one node, in either form */
+typedef struct
+{
+	MemoryReferer* referer;
+	const GraphEdge* edge;
+	const GraphEdge* end;
+} EdgeIterator;
+
+typedef struct
+{
+	jvmtiHeapReferenceInfo* details;
+	jint count;
+	jint capacity;
+} RootDetailTable;
+
+/* Number of references to a node coming from instances of one class */
+typedef struct
+{
+	NodeId classNode;
 	int count;
-	struct _ClassReferenceCount* next;
 } ClassReferenceCount;
 
+/* Most nodes are referenced from one or two classes; the rest go to an overflow hash table */
+#define FAN_IN_INLINE_SLOTS 2
+
+typedef struct
+{
+	unsigned int capacity;
+	unsigned int count;
+	ClassReferenceCount slots[1];
+} FanInOverflow;
+
+typedef struct
+{
+	ClassReferenceCount inline_slots[FAN_IN_INLINE_SLOTS];
+	FanInOverflow* overflow;
+} FanInTable;
+
 typedef struct _IgnoreField
 {
 	jint field;
@@ -84,23 +189,74 @@ typedef struct _IgnoreField
 	struct _IgnoreField* next;
 } IgnoreField;
 
-typedef struct _MemoryNode
+typedef struct
+{
+	char** names;
+	jint count;
+	jint capacity;
+} FieldNameTable;
+
+/* The cold part of a node, only created for nodes that need it (classes, leaks, printed nodes) */
+typedef struct
 {
-	jboolean visited;
-	jboolean dead;
-	jboolean classNode;
 	jclass klass;
 	jobject obj;
-	jint leak_size;
 	char* classname;
-	MemoryReferer* start;
-	MemoryReferer* last;
-	bitmask_set* leaks_related;
-	int reference_pointing_to_me;
-	ClassReferenceCount* fan_in;
 	IgnoreField* ignore_fields;
+	FieldNameTable field_names;
 } MemoryNode;
 
+#define NODE_FLAG_DEAD 1
+#define NODE_FLAG_CLASS 2
+
+#define NODE_CHUNK_BITS 12
+#define NODE_CHUNK_SIZE (1 << NODE_CHUNK_BITS)
+
+/*
+ * The per-node data used by the heap walk and the chain search, one array per field.
+ * Nodes are stored in fixed size chunks that never move, so a pointer into a chunk
+ * stays valid while the store grows.
+ */
+typedef struct
+{
+	unsigned char flags[NODE_CHUNK_SIZE];
+	jint leak_size[NODE_CHUNK_SIZE];
+	/* captured references, newest first until orderReferenceLists() or compactReferenceGraph() */
+	MemoryReferer* first_edge[NODE_CHUNK_SIZE];
+	FanInTable fan_in[NODE_CHUNK_SIZE];
+	bitmask_set leaks_related[NODE_CHUNK_SIZE];
+	MemoryNode* cold[NODE_CHUNK_SIZE];
+} NodeChunk;
+
+typedef struct
+{
+	NodeChunk** chunks;
+	unsigned int chunks_capacity;
+	/* next id to hand out */
+	NodeId next;
+} NodeStore;
+
+#define NODE_FIELD(store, id, field) ((store)->chunks[(id) >> NODE_CHUNK_BITS]->field[(id) & (NODE_CHUNK_SIZE - 1)])
+
+/* A reference already recorded in the graph: referrer -> node through kind/index */
+typedef struct
+{
+	NodeId node;
+	NodeId referrer;
+	jint kind;
+	jint index;
+} ReferenceEdge;
+
+/* Open addressing hash set of the recorded references, used to drop duplicate callbacks */
+typedef struct
+{
+	ReferenceEdge* edges;
+	unsigned int capacity;
+	unsigned int count;
+	/* set when the table reached its largest size */
+	jboolean full;
+} EdgeSet;
+
 #define OUTPUT_TYPE_FILE 1
 #define OUTPUT_TYPE_WIN32SOCK 2
 
@@ -119,20 +275,24 @@ typedef struct
 {
 	jlong thread_id;
     jclass classClass;
-    jmethodID metEquals;
-    jmethodID metGetClassName;
     JNIEnv* jni;
     SizeableClassThreadData* sizeableClasses;
     Timer timer;
-    MemoryNode** classNodes;
-    int nodes_allocated;
-    int nodes_freed;
+    jboolean classesTagged;
+    /* all the graph objects of a dump live in this arena */
+    Arena graphArena;
+    /* except the captured reference lists, released once the graph is compacted */
+    Arena refererArena;
+    NodeStore nodes;
+    EdgeSet edges;
+    RootDetailTable rootDetails;
+    EdgeIndex edgeIndex;
 	OutputStream outputStream;
 } ThreadData;
 
 typedef struct _LeakingNodes
 {
-	MemoryNode* node;
+	NodeId node;
 	jint leak_size;
 	object_print_function print_fn;
 	int leakNumber;
@@ -143,6 +303,8 @@ typedef struct
 {
 	bitmask_set* leaks_finished;
 	int* nodes_found;
+	/* set when the memory budget stopped the capture */
+	jboolean budget_exhausted;
 } FollowReferencesData;
 
 struct entryMethods
@@ -153,14 +315,21 @@ struct entryMethods
 
 extern GlobalData* gdata;
 
-MemoryNode* newMemoryNode();
-jboolean freeMemoryNode(MemoryNode* node);
+NodeId newMemoryNode();
+MemoryNode* getMemoryNode(NodeId id);
+void releaseAllMemoryNodes();
 void freeMemoryForLeakList(LeakingNodes* lstLeaks);
 void freeGlobalData();
 void initThreadData(JNIEnv* env);
 void releaseThreadData();
-jboolean hasReferenceBetweenObjects(MemoryNode* n1, MemoryNode* n2, jvmtiHeapReferenceKind reference_kind, const jvmtiHeapReferenceInfo* reference_info);
-int addReferenceClass(MemoryNode* node, MemoryNode* classNode);
+jboolean registerReferenceEdge(NodeId node, NodeId referrer, jvmtiHeapReferenceKind reference_kind, const jvmtiHeapReferenceInfo* reference_info);
+int addReferenceClass(NodeId node, NodeId classNode);
+void setEdgeInfo(GraphEdge* edge, jvmtiHeapReferenceKind reference_kind, const jvmtiHeapReferenceInfo* reference_info);
+const jvmtiHeapReferenceInfo* getRootDetails(const GraphEdge* edge);
+void orderReferenceLists();
+void compactReferenceGraph();
+void edgeIterator_init(EdgeIterator* it, NodeId node);
+const GraphEdge* edgeIterator_next(EdgeIterator* it);
 ThreadData* getThreadData();
 void startTimer(Timer*, int);
 void stopTimer(Timer*, const char*);
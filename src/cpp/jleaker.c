@@ -51,6 +51,8 @@
 #include "leak_detect.h"
 #include "jobject_print.h"
 #include "ini.h"
+#include "resident.h"
+#include "conf_cache.h"
 
 GlobalData globalData, *gdata = &globalData;
 
@@ -88,11 +90,12 @@ vmDeath(jvmtiEnv *jvmti, __UNUSED__ JNIEnv *env)
 }
 
 
-static int ini_handler(__UNUSED__ void* userData, const char* section, const char* name, const char* value)
+static int ini_handler(void* userData, const char* section, const char* name, const char* value)
 {
+	ConfRules* rules = (ConfRules*)userData;
 	if (0 == strcmp(section, "ignore_classes"))
 	{
-		sm_put(gdata->ignore_classes, name, (void*)1);
+		classPatterns_add(rules->ignore_classes, name);
 	}
 	else if (0 == strcmp(section, "ignore_referenced_by"))
 	{
@@ -130,18 +133,14 @@ static int ini_handler(__UNUSED__ void* userData, const char* section, const cha
 
     	debug("Parsing class name [%s], field [%s], limit %d\n", classname, newElement->fieldName, v);
 
-       	sm_get(gdata->ignore_referenced_by, classname, (void**)&old);
+       	sm_get(rules->ignore_referenced_by, classname, (void**)&old);
        	newElement->next = old;
-		sm_put(gdata->ignore_referenced_by, classname, newElement);
+		sm_put(rules->ignore_referenced_by, classname, newElement);
 		myFree(classname);
 	}
 	return 1;
 }
 
-static void free_class_limit(__UNUSED__ void* ptr)
-{
-}
-
 static void free_referenced_by_limit(void* ptr)
 {
 	IgnoreField* e = (IgnoreField*)ptr;
@@ -154,6 +153,199 @@ static void free_referenced_by_limit(void* ptr)
 	}
 }
 
+static void index_referenced_by_class(const char* classname, __UNUSED__ void* value, const void* obj)
+{
+	nameIndex_add((NameIndex*)obj, classname);
+}
+
+static ConfRules* newConfRules(char** confFiles, int count)
+{
+	ConfRules* rules = (ConfRules*)myAlloc(sizeof(*rules));
+	int i;
+
+	rules->ignore_classes = classPatterns_new();
+	rules->ignore_referenced_by = sm_new(10, free_referenced_by_limit);
+	rules->ignore_referenced_by_index = NULL;
+	rules->conf_count = count;
+	rules->conf_paths = (char**)myAlloc(sizeof(*rules->conf_paths) * (count + 1));
+	rules->conf_stamps = (ConfFileStamp*)myAlloc(sizeof(*rules->conf_stamps) * (count + 1));
+	for (i = 0; i < count; i++)
+	{
+		rules->conf_paths[i] = myStrdup(confFiles[i]);
+		memset(&rules->conf_stamps[i], 0, sizeof(rules->conf_stamps[i]));
+	}
+	return rules;
+}
+
+static void freeConfRules(ConfRules* rules)
+{
+	int i;
+	if (NULL == rules)
+	{
+		return;
+	}
+	classPatterns_free(&rules->ignore_classes);
+	sm_delete(rules->ignore_referenced_by);
+	nameIndex_free(&rules->ignore_referenced_by_index);
+	for (i = 0; i < rules->conf_count; i++)
+	{
+		myFree(rules->conf_paths[i]);
+	}
+	myFree(rules->conf_paths);
+	myFree(rules->conf_stamps);
+	myFree(rules);
+}
+
+/* Takes the stamps of the conf files. Returns 0 if one of them can't be read. */
+static int stampConfFiles(char** confFiles, int count, ConfFileStamp* stamps)
+{
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		if (!confCache_stampFile(confFiles[i], &stamps[i]))
+		{
+    		alert("Can't load '%s'\n", confFiles[i]);
+    		return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether the rules were read from these very conf files, none of which changed since */
+static int isConfUnchanged(const ConfRules* rules, char** confFiles, const ConfFileStamp* stamps, int count)
+{
+	int i;
+	if (rules->conf_count != count)
+	{
+		return 0;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if ((0 != strcmp(rules->conf_paths[i], confFiles[i])) ||
+				(stamps[i].size != rules->conf_stamps[i].size) || (stamps[i].hash != rules->conf_stamps[i].hash))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static ConfRules* readConfRules(char** confFiles, const ConfFileStamp* stamps, int count, jboolean forceParse)
+{
+	ConfRules* rules = newConfRules(confFiles, count);
+	int parsedCleanly = 1, i;
+
+	/* stamped before reading, so a change made while reading is picked up by the next load */
+	for (i = 0; i < count; i++)
+	{
+		rules->conf_stamps[i] = stamps[i];
+	}
+    if (!forceParse && (0 != count) && ('\0' != gdata->conf_cache[0]) && confCache_load(rules, gdata->conf_cache))
+    {
+    	return rules;
+    }
+    for (i = 0; i < count; i++)
+    {
+    	int res = ini_parse(confFiles[i], ini_handler, rules);
+    	if (res < 0)
+    	{
+    		alert("Can't load '%s'\n", confFiles[i]);
+    		freeConfRules(rules);
+    		return NULL;
+    	}
+    	parsedCleanly = parsedCleanly && (0 == res);
+    }
+    rules->ignore_referenced_by_index = nameIndex_new(sm_get_count(rules->ignore_referenced_by));
+    sm_enum(rules->ignore_referenced_by, index_referenced_by_class, rules->ignore_referenced_by_index);
+    if ((0 != count) && ('\0' != gdata->conf_cache[0]) && parsedCleanly)
+    {
+    	confCache_save(rules, gdata->conf_cache);
+    }
+    return rules;
+}
+
+/* Reads the rules of the conf files, which have the given stamps, from the cache unless forceParse
+ * is set. The rules outlive the dumps, so their blocks are left out of the leak check that follows
+ * every dump. */
+static ConfRules* loadConfRules(char** confFiles, const ConfFileStamp* stamps, int count, jboolean forceParse)
+{
+	ConfRules* rules;
+
+	beginLongLivedAllocations();
+	rules = readConfRules(confFiles, stamps, count, forceParse);
+	endLongLivedAllocations();
+	return rules;
+}
+
+#define MAX_CONF_FILES 32
+
+/* Splits the conf file list in place. Returns -1 if there are too many files. */
+static int splitConfFiles(char* allConfFiles, char** confFiles)
+{
+    int confCount = 0;
+    char* next = allConfFiles;
+
+    while ((NULL != next) && ('\0' != *next))
+    {
+    	char* end = strchr(next, PATH_SEPARATOR[0]);
+    	if (NULL != end)
+    	{
+    		*end++ = '\0';
+    	}
+    	if ('\0' != *next)
+    	{
+        	if (confCount == MAX_CONF_FILES)
+        	{
+        		alert("Error: More than %d conf files\n", MAX_CONF_FILES);
+        		return -1;
+        	}
+        	confFiles[confCount++] = next;
+    	}
+    	next = end;
+    }
+    return confCount;
+}
+
+/* Loads the rules of the conf files, unless the ones in use were read from them and they
+ * didn't change. The new rules are only handed to the next dump, so a running dump keeps its own. */
+static int prepareConfRules(char* allConfFiles)
+{
+    char *confFiles[MAX_CONF_FILES];
+    ConfFileStamp stamps[MAX_CONF_FILES];
+    int confCount, unchanged;
+    ConfRules* rules;
+
+    confCount = splitConfFiles(allConfFiles, confFiles);
+    /* the files are read outside the lock, so a slow one doesn't hold up the start of a dump */
+    if ((confCount < 0) || !stampConfFiles(confFiles, confCount, stamps))
+    {
+    	return 0;
+    }
+
+    enterAgentMonitor(gdata->jvmti); {
+    	ConfRules* current = (NULL != gdata->pending_rules) ? gdata->pending_rules : gdata->rules;
+    	unchanged = !gdata->reload_conf && (NULL != current) && isConfUnchanged(current, confFiles, stamps, confCount);
+    } exitAgentMonitor(gdata->jvmti);
+    if (unchanged)
+    {
+    	debug("jleaker: Configuration files unchanged, keeping their rules\n");
+    	return 1;
+    }
+
+    rules = loadConfRules(confFiles, stamps, confCount, gdata->reload_conf);
+    if (NULL == rules)
+    {
+    	return 0;
+    }
+    enterAgentMonitor(gdata->jvmti); {
+    	/* never used by a dump, as no dump started since it was loaded */
+    	freeConfRules(gdata->pending_rules);
+    	gdata->pending_rules = rules;
+    } exitAgentMonitor(gdata->jvmti);
+    debug("jleaker: Loaded the rules of %d configuration files\n", confCount);
+    return 1;
+}
+
 static int parse_agent_options(char *options)
 {
     char *next;
@@ -168,13 +360,20 @@ static int parse_agent_options(char *options)
 	gdata->num_elements_to_dump = 5;
 	gdata->run_gc = JNI_TRUE;
 	gdata->show_unreachables = JNI_FALSE;
-	gdata->ignore_classes = sm_new(10, free_class_limit);
-	gdata->ignore_referenced_by = sm_new(10, free_referenced_by_limit);
+	gdata->resident = JNI_FALSE;
+	gdata->compressed_sets = JNI_FALSE;
+	gdata->compact_graph = JNI_FALSE;
+	gdata->allocation_sites = JNI_FALSE;
+	gdata->huge_pages = JNI_FALSE;
+	gdata->max_agent_memory_mb = 0;
+	gdata->scratch_dir[0] = '\0';
+	gdata->conf_cache[0] = '\0';
+	gdata->reload_conf = JNI_FALSE;
 
     /* Parse options and set flags in gdata */
     if ( options==NULL )
     {
-        return 1;
+        return prepareConfRules(NULL);
     }
 
     alert("Start memory leak detection (options are %s)\n", options);
@@ -231,6 +430,18 @@ static int parse_agent_options(char *options)
         	}
         	debug("jleaker: Using max_fan_in=%d\n", gdata->max_fan_in);
     	}
+    	else if (strcmp(next,"max_agent_memory_mb") == 0)
+    	{
+    		char *endptr;
+        	next = strtok(NULL, ",");
+        	gdata->max_agent_memory_mb = strtol(next, &endptr, 10);
+        	if ((*endptr != '\0') || (gdata->max_agent_memory_mb < 0))
+        	{
+        		alert("Error: Bad max_agent_memory_mb %s\n", next);
+        		return 0;
+        	}
+        	debug("jleaker: Using max_agent_memory_mb=%d\n", gdata->max_agent_memory_mb);
+    	}
     	else if (strcmp(next,"debug") == 0)
     	{
     		gdata->debug = 1;
@@ -256,11 +467,61 @@ static int parse_agent_options(char *options)
     		all_conf_files = strtok(NULL, ",");
         	debug("jleaker: Using conf_file=%s\n", all_conf_files);
     	}
+    	else if (strcmp(next,"scratch_dir") == 0)
+    	{
+    		next = strtok(NULL, ",");
+    		if ((NULL == next) || (snprintf(gdata->scratch_dir, sizeof(gdata->scratch_dir), "%s", next) >= (int)sizeof(gdata->scratch_dir)))
+    		{
+    			alert("Error: Bad scratch_dir %s\n", (NULL == next) ? "" : next);
+    			return 0;
+    		}
+        	debug("jleaker: Using scratch_dir=%s\n", gdata->scratch_dir);
+    	}
+    	else if (strcmp(next,"conf_cache") == 0)
+    	{
+    		next = strtok(NULL, ",");
+    		if ((NULL == next) || (snprintf(gdata->conf_cache, sizeof(gdata->conf_cache), "%s", next) >= (int)sizeof(gdata->conf_cache)))
+    		{
+    			alert("Error: Bad conf_cache %s\n", (NULL == next) ? "" : next);
+    			return 0;
+    		}
+        	debug("jleaker: Using conf_cache=%s\n", gdata->conf_cache);
+    	}
     	else if (strcmp(next,"show_unreachables") == 0)
     	{
     		gdata->show_unreachables = JNI_TRUE;
         	debug("jleaker: Using show_unreachables=true\n");
     	}
+    	else if (strcmp(next,"resident") == 0)
+    	{
+    		gdata->resident = JNI_TRUE;
+        	debug("jleaker: Using resident=true\n");
+    	}
+    	else if (strcmp(next,"compressed_sets") == 0)
+    	{
+    		gdata->compressed_sets = JNI_TRUE;
+        	debug("jleaker: Using compressed_sets=true\n");
+    	}
+    	else if (strcmp(next,"compact_graph") == 0)
+    	{
+    		gdata->compact_graph = JNI_TRUE;
+        	debug("jleaker: Using compact_graph=true\n");
+    	}
+    	else if (strcmp(next,"allocation_sites") == 0)
+    	{
+    		gdata->allocation_sites = JNI_TRUE;
+        	debug("jleaker: Using allocation_sites=true\n");
+    	}
+    	else if (strcmp(next,"huge_pages") == 0)
+    	{
+    		gdata->huge_pages = JNI_TRUE;
+        	debug("jleaker: Using huge_pages=true\n");
+    	}
+    	else if (strcmp(next,"reload_conf") == 0)
+    	{
+    		gdata->reload_conf = JNI_TRUE;
+        	debug("jleaker: Using reload_conf=true\n");
+    	}
     	else
     	{
     		/* We got a non-empty token and we don't know what it is. */
@@ -270,21 +531,7 @@ static int parse_agent_options(char *options)
     	next = strtok(NULL, ",=");
     }
 
-    if (NULL != all_conf_files)
-    {
-        next = strtok(all_conf_files, PATH_SEPARATOR);
-        while (NULL != next)
-        {
-        	if (ini_parse(next, ini_handler, NULL) < 0)
-        	{
-        		alert("Can't load '%s'\n", next);
-        		return 0;
-        	}
-        	next = strtok(NULL, PATH_SEPARATOR);
-        }
-    }
-
-    return 1;
+    return prepareConfRules(all_conf_files);
 }
 
 #ifndef JNICALL
@@ -301,6 +548,26 @@ static jboolean __sync_lock_test_and_set(jboolean* x,jboolean y)
 }
 #endif
 
+static void printAllocationSites()
+{
+	int i, count;
+	AllocationSiteStats* sites = getAllocationSites(&count);
+
+	open_xml_element("allocation-sites", NULL);
+	for (i = 0; i < count; i++)
+	{
+		char line[16], allocations[32], current[32], peak[32];
+		snprintf(line, sizeof(line), "%d", sites[i].line);
+		snprintf(allocations, sizeof(allocations), "%lu", (unsigned long)sites[i].count);
+		snprintf(current, sizeof(current), "%lu", (unsigned long)sites[i].currentBytes);
+		snprintf(peak, sizeof(peak), "%lu", (unsigned long)sites[i].peakBytes);
+		complete_xml_element("allocation-site", "file", sites[i].file, "line", line, "count", allocations,
+				"current-bytes", current, "peak-bytes", peak, NULL);
+	}
+	close_xml_element("allocation-sites");
+	myFree(sites);
+}
+
 static void JNICALL dumperThreadMain(__UNUSED__ jvmtiEnv* jvmti, JNIEnv* jni_env, __UNUSED__ void* arg)
 {
 	char* internalLeaksString;
@@ -310,6 +577,21 @@ static void JNICALL dumperThreadMain(__UNUSED__ jvmtiEnv* jvmti, JNIEnv* jni_env
     	alert("Another dump is already in progress");
     	return;
     }
+    enableAllocatorCache();
+    enterAgentMonitor(jvmti); {
+    	if (NULL != gdata->pending_rules)
+    	{
+    		freeConfRules(gdata->rules);
+    		gdata->rules = gdata->pending_rules;
+    		gdata->pending_rules = NULL;
+    	}
+    	else if (NULL == gdata->rules)
+    	{
+    		/* every attach leaves rules, this only keeps a dump from going without */
+    		alert("jleaker: No configuration rules loaded, dumping without them\n");
+    		gdata->rules = loadConfRules(NULL, NULL, 0, JNI_FALSE);
+    	}
+    } exitAgentMonitor(jvmti);
 	gdata->numberOfLeaks = 0;
 	initThreadData(jni_env);
 
@@ -330,6 +612,10 @@ static void JNICALL dumperThreadMain(__UNUSED__ jvmtiEnv* jvmti, JNIEnv* jni_env
 
 	tagAllMapsAndCollections();
 	findLeaksInTaggedObjects();
+	if (gdata->allocation_sites)
+	{
+		printAllocationSites();
+	}
 
 	close_xml_element("memory-leaks");
 
@@ -337,7 +623,8 @@ static void JNICALL dumperThreadMain(__UNUSED__ jvmtiEnv* jvmti, JNIEnv* jni_env
 
 	stopTimer(&getThreadData()->timer, "Finished leak detection");
     releaseThreadData();
-    
+    releaseAllocatorCache();
+
 	internalLeaksString = findInternalMallocsLeaks();
     if (NULL != internalLeaksString)
     {
@@ -445,6 +732,16 @@ static jint initAgent(JavaVM *vm, char *options)
     {
     	return 1;
     }
+    setAllocatorBudget((size_t)gdata->max_agent_memory_mb << 20);
+    if (gdata->allocation_sites)
+    {
+    	enableAllocationSites();
+    }
+
+    if (gdata->resident && !enableResidentClassifier(vm))
+    {
+    	return 1;
+    }
 
     return 0;
 }
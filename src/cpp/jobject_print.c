@@ -197,6 +197,10 @@ static SizeableClassDescriptor classDescriptors[] =
 void initClassesToCheck()
 {
 	gdata->sizeableClassesNum = sizeof(classDescriptors)/sizeof(classDescriptors[0]);
+	if (gdata->sizeableClassesNum > MAX_SIZEABLE_CLASSES)
+	{
+		fatal_error("Too many sizeable classes: %d (max %d)\n", gdata->sizeableClassesNum, MAX_SIZEABLE_CLASSES);
+	}
 	gdata->sizeableClasses = classDescriptors;
 }
 
@@ -8,18 +8,21 @@ static const char* UNKNOWN_FIELD_NAME = "<Unknown>";
 
 extern GlobalData* gdata;
 
-static void fillClassInMemoryNode(MemoryNode* node)
+static void fillClassInMemoryNode(NodeId id)
 {
-	JNIEnv* env = getThreadData()->jni;
+	ThreadData* tdata = getThreadData();
+	JNIEnv* env = tdata->jni;
+	MemoryNode* node;
 
-	if (NULL == node)
+	if (NO_NODE == id)
 	{
 		fatal_error("node is null at %s:%d\n",__FILE__,__LINE__);
 	}
-	if (JNI_FALSE != node->dead)
+	if (0 != (NODE_FIELD(&tdata->nodes, id, flags) & NODE_FLAG_DEAD))
 	{
 		return;
 	}
+	node = getMemoryNode(id);
 	if (NULL != node->klass)
 	{
 		return;
@@ -29,14 +32,14 @@ static void fillClassInMemoryNode(MemoryNode* node)
 		jobject* obj_ptr = NULL;
 		jlong* tag_ptr = NULL;
 		jint count, err;
-		jlong tag = (jlong)(intptr_t)node;
+		jlong tag = NODE_TAG(id);
 
 		err = (*gdata->jvmti)->GetObjectsWithTags(gdata->jvmti, 1, &tag, &count, &obj_ptr, &tag_ptr);
 		check_jvmti_error(gdata->jvmti, err, "get objects with tags");
 
 		if (0 == count)
 		{
-			node->dead = JNI_TRUE;
+			NODE_FIELD(&tdata->nodes, id, flags) |= NODE_FLAG_DEAD;
 			if (NULL != obj_ptr) deallocate(gdata->jvmti, obj_ptr);
 			if (NULL != tag_ptr) deallocate(gdata->jvmti, tag_ptr);
 			return;
@@ -58,11 +61,10 @@ static jboolean findInterfaceInList(InterfaceList* lstIntr, jclass intr)
 {
 	InterfaceList** last = &lstIntr->next;
 	InterfaceList* iter = *last;
-	jmethodID metEquals = getThreadData()->metEquals;
 	JNIEnv* env = getThreadData()->jni;
 	while (NULL != iter)
 	{
-		if ((*env)->CallBooleanMethod(env, iter->intr, metEquals, intr))
+		if ((*env)->IsSameObject(env, iter->intr, intr))
 		{
 			(*env)->DeleteLocalRef(env, intr);
 			return JNI_TRUE;
@@ -76,177 +78,208 @@ static jboolean findInterfaceInList(InterfaceList* lstIntr, jclass intr)
 	return JNI_FALSE;
 }
 
-static void removeImplementedInterfacesFromIndex(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, jint* idx, InterfaceList* lstIntr)
+static void freeInterfaceList(JNIEnv* env, InterfaceList* lstIntr)
 {
-	jint intr_count, err;
-	jclass *intr_ptr = NULL;
-	int i;
-
-	err = (*jvmti)->GetImplementedInterfaces(jvmti, klass, &intr_count, &intr_ptr);
-	check_jvmti_error(jvmti, err, "get implemented interfaces");
-
-	for (i = 0; i < intr_count; i++)
+	while (NULL != lstIntr)
 	{
-		jint field_cnt;
-		jfieldID* dummy = NULL;
-		if (findInterfaceInList(lstIntr, intr_ptr[i]))
+		InterfaceList* next = lstIntr->next;
+		if (0L != (jlong)(intptr_t)lstIntr->intr)
 		{
-			continue;
+			(*env)->DeleteLocalRef(env, lstIntr->intr);
 		}
-		removeImplementedInterfacesFromIndex(jvmti, env, intr_ptr[i], idx, lstIntr);
-		err = (*jvmti)->GetClassFields(jvmti, intr_ptr[i], &field_cnt, &dummy);
-		check_jvmti_error(jvmti, err, "get class fields");
-
-		deallocate(jvmti, dummy);
-		*idx -= field_cnt;
+		myFree(lstIntr);
+		lstIntr = next;
 	}
-	deallocate(jvmti, intr_ptr);
 }
 
-jboolean getFieldOffsetInternal(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, char* name, jint* idx, InterfaceList* lstIntr)
+static void appendDeclaredFieldNames(jvmtiEnv* jvmti, jclass klass, FieldNameTable* table)
 {
-	jint tmp_idx = 0, count, err;
-	jclass super;
+	jint count, err;
 	jfieldID* all_fields = NULL;
 	int i;
 
-	removeImplementedInterfacesFromIndex(jvmti, env, klass, &tmp_idx, lstIntr);
-	*idx = *idx-tmp_idx;
-
-	super = (*env)->GetSuperclass(env, klass);
-	if (NULL != super)
+	err = (*jvmti)->GetClassFields(jvmti, klass, &count, &all_fields);
+	check_jvmti_error(jvmti, err, "get class fields");
+	if (table->count + count >= table->capacity)
 	{
-		if (getFieldOffsetInternal(jvmti, env, super, name, idx, lstIntr))
+		char** names;
+		table->capacity = 2 * (table->count + count) + 1;
+		names = myAlloc(sizeof(*names) * table->capacity);
+		if (NULL != table->names)
 		{
-			return JNI_TRUE;
+			memcpy(names, table->names, sizeof(*names) * table->count);
+			myFree(table->names);
 		}
+		table->names = names;
 	}
-
-	err = (*jvmti)->GetClassFields(jvmti, klass, &count, &all_fields);
-	check_jvmti_error(jvmti, err, "get class fields");
 	for (i = 0; i < count; i++)
 	{
 		char* fieldname;
 		err = (*jvmti)->GetFieldName(jvmti, klass, all_fields[i], &fieldname, NULL, NULL);
 		check_jvmti_error(jvmti, err, "get field name");
-		if (0 == strcmp(name, fieldname))
-		{
-			deallocate(jvmti, fieldname);
-			deallocate(jvmti, all_fields);
-			*idx += i;
-			return JNI_TRUE;
-		}
+		table->names[table->count++] = myStrdup(fieldname);
 		deallocate(jvmti, fieldname);
 	}
+	table->names[table->count] = NULL;
 	deallocate(jvmti, all_fields);
-	*idx += count;
-	return JNI_FALSE;
 }
 
-static void freeInterfaceList(JNIEnv* env, InterfaceList* lstIntr)
+static void appendImplementedInterfacesFieldNames(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, FieldNameTable* table, InterfaceList* lstIntr)
 {
-	while (NULL != lstIntr)
+	jint intr_count, err;
+	jclass *intr_ptr = NULL;
+	int i;
+
+	err = (*jvmti)->GetImplementedInterfaces(jvmti, klass, &intr_count, &intr_ptr);
+	check_jvmti_error(jvmti, err, "get implemented interfaces");
+
+	for (i = 0; i < intr_count; i++)
 	{
-		InterfaceList* next = lstIntr->next;
-		if (0L != (jlong)(intptr_t)lstIntr->intr)
+		if (findInterfaceInList(lstIntr, intr_ptr[i]))
 		{
-			(*env)->DeleteLocalRef(env, lstIntr->intr);
+			continue;
 		}
-		myFree(lstIntr);
-		lstIntr = next;
+		appendImplementedInterfacesFieldNames(jvmti, env, intr_ptr[i], table, lstIntr);
+		appendDeclaredFieldNames(jvmti, intr_ptr[i], table);
+	}
+	deallocate(jvmti, intr_ptr);
+}
+
+/* Lays out field names in JVMTI field index order: the fields of the implemented interfaces
+ * come first, then the fields of the superclass (recursively), then the fields declared by the class itself */
+static void appendFieldNames(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, FieldNameTable* table, InterfaceList* lstIntr)
+{
+	jclass super;
+
+	appendImplementedInterfacesFieldNames(jvmti, env, klass, table, lstIntr);
+	super = (*env)->GetSuperclass(env, klass);
+	if (NULL != super)
+	{
+		appendFieldNames(jvmti, env, super, table, lstIntr);
+		(*env)->DeleteLocalRef(env, super);
 	}
+	appendDeclaredFieldNames(jvmti, klass, table);
 }
 
-jint getFieldOffset(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, char* name)
+static void buildFieldNameTable(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, FieldNameTable* table)
 {
 	InterfaceList* lstIntr = myAlloc(sizeof(*lstIntr));
-	jint idx = 0;
-	jboolean res;
 	memset(lstIntr, 0, sizeof(*lstIntr));
-	res = getFieldOffsetInternal(jvmti, env, klass, name, &idx, lstIntr);
+	memset(table, 0, sizeof(*table));
+	appendFieldNames(jvmti, env, klass, table, lstIntr);
 	freeInterfaceList(env, lstIntr);
-	if (res)
+}
+
+void freeFieldNameTable(FieldNameTable* table)
+{
+	jint i;
+	if (NULL == table->names)
+	{
+		return;
+	}
+	for (i = 0; i < table->count; i++)
 	{
-		return idx;
+		myFree(table->names[i]);
 	}
-	return -1;
+	myFree(table->names);
+	memset(table, 0, sizeof(*table));
 }
 
-static char* getFieldNameByIndexInternal(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, jint* idx, InterfaceList* lstIntr)
+/* The table is built once per class node and kept until the node is freed */
+static FieldNameTable* getFieldNameTable(jvmtiEnv* jvmti, JNIEnv* env, MemoryNode* classNode)
 {
-	jfieldID* all_fields, fieldID = NULL;
-	jint count, err;
-	jclass super;
-	char* field;
-
-	removeImplementedInterfacesFromIndex(jvmti, env, klass, idx, lstIntr);
-	super = (*env)->GetSuperclass(env, klass);
-	if (NULL != super)
+	if (NULL == classNode->field_names.names)
 	{
-		field = getFieldNameByIndexInternal(jvmti, env, super, idx, lstIntr);
-		if (NULL != field)
-		{
-			return field;
-		}
+		buildFieldNameTable(jvmti, env, (jclass)classNode->obj, &classNode->field_names);
 	}
+	return &classNode->field_names;
+}
 
-	err = (*jvmti)->GetClassFields(jvmti, klass, &count, &all_fields);
-	check_jvmti_error(jvmti, err, "get class fields");
-	if (*idx < 0)
+static MemoryNode* getClassNode(jvmtiEnv* jvmti, jclass klass)
+{
+	jlong tag;
+	NodeId id;
+	jint err = (*jvmti)->GetTag(jvmti, klass, &tag);
+	check_jvmti_error(jvmti, err, "get tag");
+	if (!IS_NODE_TAG(tag))
 	{
-		alert("Index is %d, count is %d at %s:%d\n", *idx, count, __FILE__, __LINE__);
 		return NULL;
 	}
-	if (*idx < count)
+	id = NODE_ID_OF_TAG(tag);
+	if (0 == (NODE_FIELD(&getThreadData()->nodes, id, flags) & NODE_FLAG_CLASS))
 	{
-		fieldID = all_fields[(int)*idx];
+		return NULL;
 	}
-	deallocate(jvmti, all_fields);
+	return getMemoryNode(id);
+}
 
-	if (NULL != fieldID)
+jint getFieldOffset(jvmtiEnv* jvmti, JNIEnv* env, MemoryNode* classNode, const char* name)
+{
+	FieldNameTable* table = getFieldNameTable(jvmti, env, classNode);
+	jint i;
+	for (i = 0; i < table->count; i++)
 	{
-		char* fieldname;
-		err = (*jvmti)->GetFieldName(jvmti, klass, fieldID, &fieldname, NULL, NULL);
-		check_jvmti_error(jvmti, err, "get field name");
-		field = myStrdup(fieldname);
-
-		deallocate(jvmti, fieldname);
-		return field;
+		if (0 == strcmp(name, table->names[i]))
+		{
+			return i;
+		}
 	}
-	*idx -= count;
-	return NULL;
+	return -1;
 }
 
-static char* getFieldNameByIndex(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, jint* idx)
+static char* getFieldNameByIndex(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, jint idx)
 {
-	InterfaceList* lstIntr = myAlloc(sizeof(*lstIntr));
-	char* res;
-	memset(lstIntr, 0, sizeof(*lstIntr));
-	res = getFieldNameByIndexInternal(jvmti, env, klass, idx, lstIntr);
-	freeInterfaceList(env, lstIntr);
+	MemoryNode* classNode = getClassNode(jvmti, klass);
+	FieldNameTable tmpTable, *table;
+	char* res = NULL;
+
+	if (NULL != classNode)
+	{
+		table = getFieldNameTable(jvmti, env, classNode);
+	}
+	else
+	{
+		/* class wasn't tagged (e.g. loaded after tagging) - fall back to a throw-away table */
+		buildFieldNameTable(jvmti, env, klass, &tmpTable);
+		table = &tmpTable;
+	}
+	if ((idx < 0) || (idx >= table->count))
+	{
+		alert("Index is %d, count is %d at %s:%d\n", (int)idx, (int)table->count, __FILE__, __LINE__);
+	}
+	else
+	{
+		res = myStrdup(table->names[idx]);
+	}
+	if (table == &tmpTable)
+	{
+		freeFieldNameTable(&tmpTable);
+	}
 	return res;
 }
 
-static void printSingleReference(jvmtiEnv* jvmti, JNIEnv* env, MemoryReferer *ref)
+static void printSingleReference(jvmtiEnv* jvmti, JNIEnv* env, const GraphEdge* ref)
 {
 	int sz;
 	jint err, idx;
 	char* msg = NULL;
+	MemoryNode* node = NULL;
 
-	if (NULL != ref->node)
+	if (NO_NODE != ref->node)
 	{
 		fillClassInMemoryNode(ref->node);
+		node = getMemoryNode(ref->node);
 	}
 	switch (ref->kind)
 	{
 	case JVMTI_HEAP_REFERENCE_STATIC_FIELD:
 	{
 		char* fieldname;
-		char* classname = get_class_name(jvmti, env, ref->node->obj);
+		char* classname = get_class_name(jvmti, env, node->obj);
 		int freeFieldname = 1;
 
-		idx = ref->info.field.index;
-		fieldname = getFieldNameByIndex(jvmti, env, ref->node->obj, &idx);
+		idx = ref->index;
+		fieldname = getFieldNameByIndex(jvmti, env, node->obj, idx);
 		if (NULL == fieldname)
 		{
 			freeFieldname = 0;
@@ -269,18 +302,18 @@ static void printSingleReference(jvmtiEnv* jvmti, JNIEnv* env, MemoryReferer *re
 		char* fieldname;
 		int freeFieldname = 1;
 
-		idx = ref->info.field.index;
-		fieldname = getFieldNameByIndex(jvmti, env, ref->node->klass, &idx);
+		idx = ref->index;
+		fieldname = getFieldNameByIndex(jvmti, env, node->klass, idx);
 		if (NULL == fieldname)
 		{
 			freeFieldname = 0;
 			fieldname = (char*)UNKNOWN_FIELD_NAME;
 		}
 
-		sz = strlen(ref->node->classname) + strlen(fieldname) + 32;
+		sz = strlen(node->classname) + strlen(fieldname) + 32;
 		msg = (char*)myAlloc(sizeof(*msg) * sz);
 
-		snprintf(msg, sz, "%s.%s", ref->node->classname, fieldname);
+		snprintf(msg, sz, "%s.%s", node->classname, fieldname);
 		if (freeFieldname)
 		{
 			myFree(fieldname);
@@ -289,15 +322,15 @@ static void printSingleReference(jvmtiEnv* jvmti, JNIEnv* env, MemoryReferer *re
 	break;
 	case JVMTI_HEAP_REFERENCE_ARRAY_ELEMENT:
 	{
-		idx = ref->info.array.index;
-		sz = 48 + strlen(ref->node->classname);
+		idx = ref->index;
+		sz = 48 + strlen(node->classname);
 		msg = (char*)myAlloc(sizeof(*msg) * sz);
-		snprintf(msg, sz, "%s element number %d", ref->node->classname, (int)idx);
+		snprintf(msg, sz, "%s element number %d", node->classname, (int)idx);
 	}
 	break;
 	case JVMTI_HEAP_REFERENCE_CONSTANT_POOL:
 	{
-		idx = ref->info.constant_pool.index;
+		idx = ref->index;
 		sz = 16;
 		msg = (char*)myAlloc(sizeof(*msg) * sz);
 		snprintf(msg, sz, "#%d", (int)idx);
@@ -308,10 +341,11 @@ static void printSingleReference(jvmtiEnv* jvmti, JNIEnv* env, MemoryReferer *re
 		char* methodName;
 		char* methodDesc;
 		char* classname;
-		jint modifiers, slot = ref->info.stack_local.slot;
+		const jvmtiHeapReferenceInfo* details = getRootDetails(ref);
+		jint modifiers, slot = details->stack_local.slot;
 		jclass myClass;
-		jmethodID method = ref->info.stack_local.method;
-		long threadID = ref->info.stack_local.thread_id;
+		jmethodID method = details->stack_local.method;
+		long threadID = details->stack_local.thread_id;
 
 		err = (*jvmti)->GetMethodDeclaringClass(jvmti, method, &myClass);
 		check_jvmti_error(jvmti, err, "GetMethodDeclaringClass");
@@ -355,8 +389,9 @@ static void printSingleReference(jvmtiEnv* jvmti, JNIEnv* env, MemoryReferer *re
 	{
 		char* methodName;
 		char* methodDesc;
-		jmethodID metID = ref->info.jni_local.method;
-		long threadID = (long)ref->info.jni_local.thread_id;
+		const jvmtiHeapReferenceInfo* details = getRootDetails(ref);
+		jmethodID metID = details->jni_local.method;
+		long threadID = (long)details->jni_local.thread_id;
 
 		if (0 == metID)
 		{
@@ -412,75 +447,201 @@ static void printSingleReference(jvmtiEnv* jvmti, JNIEnv* env, MemoryReferer *re
 	}
 }
 
-static OrderedReferences* generateReferencesChainForNode(jvmtiEnv* jvmti, JNIEnv* env, MemoryNode* node, int leakNumber)
+/* FIFO of nodes for the chain search, a ring buffer that grows with the search frontier */
+typedef struct
 {
-	OrderedReferences* orderedRefs = NULL;
-	if (node->visited != JNI_FALSE)
+	NodeId* nodes;
+	int capacity;
+	int head;
+	int count;
+} NodeQueue;
+
+static void pushNode(NodeQueue* q, NodeId node)
+{
+	if (q->count == q->capacity)
 	{
-		return NULL;
+		int newCapacity = (0 == q->capacity) ? 64 : 2 * q->capacity;
+		NodeId* nodes = myAlloc(sizeof(*nodes) * newCapacity);
+		int i;
+		for (i = 0; i < q->count; i++)
+		{
+			nodes[i] = q->nodes[(q->head + i) % q->capacity];
+		}
+		if (NULL != q->nodes)
+		{
+			myFree(q->nodes);
+		}
+		q->nodes = nodes;
+		q->capacity = newCapacity;
+		q->head = 0;
+	}
+	q->nodes[(q->head + q->count) % q->capacity] = node;
+	q->count++;
+}
+
+static NodeId popNode(NodeQueue* q)
+{
+	NodeId node = q->nodes[q->head];
+	q->head = (q->head + 1) % q->capacity;
+	q->count--;
+	return node;
+}
+
+/* Chain search state of one node chunk: the search that reached the node, from which node and through which reference */
+typedef struct
+{
+	int mark[NODE_CHUNK_SIZE];
+	NodeId from[NODE_CHUNK_SIZE];
+	const GraphEdge* via[NODE_CHUNK_SIZE];
+} SearchChunk;
+
+/* Side table of the chain search, held only while the chains are printed.
+ * A chunk is allocated when the search first reaches one of its nodes. */
+typedef struct
+{
+	SearchChunk** chunks;
+	unsigned int count;
+} SearchState;
+
+#define SEARCH_FIELD(state, id, field) ((state)->chunks[(id) >> NODE_CHUNK_BITS]->field[(id) & (NODE_CHUNK_SIZE - 1)])
+
+static void searchState_init(SearchState* state, const NodeStore* nodes)
+{
+	state->count = (nodes->next + NODE_CHUNK_SIZE - 1) >> NODE_CHUNK_BITS;
+	state->chunks = NULL;
+	if (state->count > 0)
+	{
+		state->chunks = (SearchChunk**)myAlloc(sizeof(*state->chunks) * state->count);
+		memset(state->chunks, 0, sizeof(*state->chunks) * state->count);
+	}
+}
+
+static void searchState_free(SearchState* state)
+{
+	unsigned int i;
+	for (i = 0; i < state->count; i++)
+	{
+		if (NULL != state->chunks[i])
+		{
+			myFree(state->chunks[i]);
+		}
 	}
-	if (!bitMapSet_contains(node->leaks_related, leakNumber))
+	if (NULL != state->chunks)
+	{
+		myFree(state->chunks);
+	}
+}
+
+static jboolean searchState_isMarked(const SearchState* state, NodeId node, int searchMark)
+{
+	SearchChunk* chunk = state->chunks[node >> NODE_CHUNK_BITS];
+	return ((NULL != chunk) && (chunk->mark[node & (NODE_CHUNK_SIZE - 1)] == searchMark)) ? JNI_TRUE : JNI_FALSE;
+}
+
+static void searchState_mark(SearchState* state, NodeId node, int searchMark, NodeId from, const GraphEdge* via)
+{
+	SearchChunk** chunk = &state->chunks[node >> NODE_CHUNK_BITS];
+	if (NULL == *chunk)
+	{
+		*chunk = (SearchChunk*)myAlloc(sizeof(**chunk));
+		memset(*chunk, 0, sizeof(**chunk));
+	}
+	SEARCH_FIELD(state, node, mark) = searchMark;
+	SEARCH_FIELD(state, node, from) = from;
+	SEARCH_FIELD(state, node, via) = via;
+}
+
+/* Builds the chain from the leaking node up to the root reference found on the given node,
+ * following the references the search came through. Returns the last element of a circular list. */
+static OrderedReferences* buildReferencesChain(SearchState* state, NodeId node, const GraphEdge* rootRef)
+{
+	Arena* arena = &getThreadData()->graphArena;
+	OrderedReferences* last = (OrderedReferences*)arenaAlloc(arena, sizeof(*last));
+
+	last->next = last;
+	last->ref = rootRef;
+	for (; NULL != SEARCH_FIELD(state, node, via); node = SEARCH_FIELD(state, node, from))
+	{
+		OrderedReferences* first = (OrderedReferences*)arenaAlloc(arena, sizeof(*first));
+		first->ref = SEARCH_FIELD(state, node, via);
+		first->next = last->next;
+		last->next = first;
+	}
+	return last;
+}
+
+/* Breadth first search from the leaking node towards the roots, so the chain found is the shortest one.
+ * Nodes are marked with the leak number, so no clean up is needed between searches. */
+static OrderedReferences* generateReferencesChainForNode(__UNUSED__ jvmtiEnv* jvmti, __UNUSED__ JNIEnv* env, SearchState* state, NodeId start, int leakNumber)
+{
+	NodeStore* nodes = &getThreadData()->nodes;
+	OrderedReferences* orderedRefs = NULL;
+	NodeQueue queue;
+	int searchMark = leakNumber + 1;
+
+	if (!bitMapSet_contains(&NODE_FIELD(nodes, start, leaks_related), leakNumber))
 	{
 		return NULL;
 	}
-	node->visited = JNI_TRUE;
-	fillClassInMemoryNode(node);
-	if (JNI_FALSE == node->dead)
+	memset(&queue, 0, sizeof(queue));
+	searchState_mark(state, start, searchMark, NO_NODE, NULL);
+	pushNode(&queue, start);
+
+	while ((NULL == orderedRefs) && (queue.count > 0))
 	{
-		MemoryReferer* ref = node->start;
-		while (NULL != ref)
+		NodeId node = popNode(&queue);
+		const GraphEdge* ref;
+		EdgeIterator it;
+
+		fillClassInMemoryNode(node);
+		if (0 != (NODE_FIELD(nodes, node, flags) & NODE_FLAG_DEAD))
+		{
+			continue;
+		}
+		edgeIterator_init(&it, node);
+		while (NULL != (ref = edgeIterator_next(&it)))
 		{
+			NodeId refNode = ref->node;
 			if (JNI_FALSE == shouldConsiderThisReference(ref->kind))
 			{
-				//do nothing
+				continue;
 			}
-			else if (JNI_FALSE == isRootReference(ref->kind))
+			if (isRootReference(ref->kind))
 			{
-				if (NULL == ref->node)
-				{
-					fatal_error("Node is null. kind is %d\n", ref->kind);
-				}
-				orderedRefs = generateReferencesChainForNode(jvmti, env, ref->node, leakNumber);
-				if (NULL == orderedRefs)
-				{
-					//we didn't find any reference chain to root in the context of this leak - lets not scan it again
-					bitMapSet_remove(node->leaks_related, leakNumber);
-				}
-				else
-				{
-					OrderedReferences* first = orderedRefs->next;
-
-					orderedRefs->next = (OrderedReferences*)myAlloc(sizeof(*orderedRefs));
-					orderedRefs->next->next = first;
-					orderedRefs->next->ref = ref;
-					break;
-				}
+				orderedRefs = buildReferencesChain(state, node, ref);
+				break;
 			}
-			else
+			if (NO_NODE == refNode)
 			{
-				orderedRefs = (OrderedReferences*)myAlloc(sizeof(*orderedRefs));
-				orderedRefs->next = orderedRefs;
-				orderedRefs->ref = ref;
-				break;
+				fatal_error("Node is null. kind is %d\n", ref->kind);
 			}
-
-			ref = ref->next;
+			if (searchState_isMarked(state, refNode, searchMark) || !bitMapSet_contains(&NODE_FIELD(nodes, refNode, leaks_related), leakNumber))
+			{
+				continue;
+			}
+			searchState_mark(state, refNode, searchMark, node, ref);
+			pushNode(&queue, refNode);
 		}
 	}
-	node->visited = JNI_FALSE;
+
+	if (NULL != queue.nodes)
+	{
+		myFree(queue.nodes);
+	}
 	return orderedRefs;
 }
 
 
-static void printAllReferencesToNode(jvmtiEnv* jvmti, JNIEnv* env, MemoryNode* node)
+static void printAllReferencesToNode(jvmtiEnv* jvmti, JNIEnv* env, NodeId node)
 {
-	MemoryReferer *ref = node->start;
+	const GraphEdge* ref;
+	EdgeIterator it;
 
+	edgeIterator_init(&it, node);
 	open_xml_element("references", NULL);
-	while (NULL != ref)
+	while (NULL != (ref = edgeIterator_next(&it)))
 	{
 		printSingleReference(jvmti, env, ref);
-		ref = ref->next;
 	}
 	close_xml_element("references");
 }
@@ -495,7 +656,6 @@ static void printReferenceChainToNode(jvmtiEnv* jvmti, JNIEnv* env, OrderedRefer
 		orderedRefs = next;
 		next = orderedRefs->next;
 		printSingleReference(jvmti, env, orderedRefs->ref);
-		myFree(orderedRefs);
 	}
 	while (orderedRefs != last);
 	close_xml_element("reference-chain-to-root");
@@ -507,23 +667,27 @@ void printReferencesChainForLeakingNodes(LeakingNodes* lstLeaks, int isNeedRefer
 	LeakingNodes* leak = lstLeaks;
 	jvmtiEnv* jvmti = gdata->jvmti;
 	JNIEnv* env = getThreadData()->jni;
+	SearchState state;
 
+	searchState_init(&state, &getThreadData()->nodes);
 	while (NULL != leak)
 	{
 		char leakSizeStr[32];
-		MemoryNode* n = leak->node;
+		NodeId n = leak->node;
+		MemoryNode* node;
 
 		OrderedReferences* orderedRefs = NULL;
 		if (isNeedReferences)
 		{
-			orderedRefs = generateReferencesChainForNode(jvmti, env, n, leak->leakNumber);
+			orderedRefs = generateReferencesChainForNode(jvmti, env, &state, n, leak->leakNumber);
 		}
 		if (NULL != orderedRefs || gdata->show_unreachables)
 		{
 			fillClassInMemoryNode(n);
+			node = getMemoryNode(n);
 			snprintf(leakSizeStr, sizeof(leakSizeStr), "%d", leak->leak_size);
-			open_xml_element("leaking-object","class", n->classname, "size", leakSizeStr, NULL);
-			(*leak->print_fn)(n->obj);
+			open_xml_element("leaking-object","class", node->classname, "size", leakSizeStr, NULL);
+			(*leak->print_fn)(node->obj);
 			if (isNeedReferences)
 			{
 				if (NULL == orderedRefs)
@@ -539,10 +703,11 @@ void printReferencesChainForLeakingNodes(LeakingNodes* lstLeaks, int isNeedRefer
 		}
 		else
 		{
-			debug("jleaker: ignore leak in class %s\n", n->classname);
+			debug("jleaker: ignore leak in class %s\n", getMemoryNode(n)->classname);
 		}
 		leak = leak->next;
 	}
+	searchState_free(&state);
 }
 
 jboolean localReferenceOfThisThread(jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo* info)
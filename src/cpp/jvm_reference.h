@@ -12,12 +12,13 @@ typedef struct _InterfaceList
 
 typedef struct _OrderedReferences
 {
-	MemoryReferer* ref;
+	const GraphEdge* ref;
 	struct _OrderedReferences* next;
 } OrderedReferences;
 
 
-jint getFieldOffset(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, char* name);
+jint getFieldOffset(jvmtiEnv* jvmti, JNIEnv* env, MemoryNode* classNode, const char* name);
+void freeFieldNameTable(FieldNameTable* table);
 jboolean localReferenceOfThisThread(jvmtiHeapReferenceKind kind, const jvmtiHeapReferenceInfo* info);
 jboolean isRootReference(jvmtiHeapReferenceKind);
 jboolean shouldConsiderThisReference(jvmtiHeapReferenceKind kind);
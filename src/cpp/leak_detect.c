@@ -4,6 +4,7 @@
 #include "jvm_reference.h"
 #include "agent_util.h"
 #include "jobject_print.h"
+#include "resident.h"
 
 #define INITIAL_CLASS_TAG ((jlong)0xBadCafe)
 #define CLASS_CLASS_INITIAL_TAG ((jlong)0xFeedDad)
@@ -37,16 +38,18 @@ cbHeapObject(__UNUSED__ jvmtiHeapReferenceKind reference_kind,
 }
 
 
-static jboolean isFieldIgnored(MemoryNode* refClassNode, MemoryNode* thisNode, jint fieldIndex)
+static jboolean isFieldIgnored(NodeStore* nodes, NodeId refClassNode, NodeId thisNode, jint fieldIndex)
 {
-	IgnoreField* ignoreFields = refClassNode->ignore_fields;
+	MemoryNode* classNode = NODE_FIELD(nodes, refClassNode, cold);
+	IgnoreField* ignoreFields = (NULL != classNode) ? classNode->ignore_fields : NULL;
+	jint leakSize = NODE_FIELD(nodes, thisNode, leak_size);
 	while (NULL != ignoreFields)
 	{
 		if (ignoreFields->field == fieldIndex)
 		{
-			if (thisNode->leak_size < ignoreFields->threshold)
+			if (leakSize < ignoreFields->threshold)
 			{
-				debug("\tField name=%s, Size=%d, threshold=%d\n", ignoreFields->fieldName, (int)thisNode->leak_size, ignoreFields->threshold);
+				debug("\tField name=%s, Size=%d, threshold=%d\n", ignoreFields->fieldName, (int)leakSize, ignoreFields->threshold);
 				return JNI_TRUE;
 			}
 		}
@@ -64,7 +67,9 @@ cbObjectTagReferrer(jvmtiHeapReferenceKind reference_kind,
      jlong* tag_ptr, jlong* referrer_tag_ptr, __UNUSED__ jint length, void* user_data)
 {
 	FollowReferencesData* data;
-	MemoryNode* thisNode, *refNode;
+	NodeStore* nodes;
+	NodeId thisNode, refNode, refClassNode;
+	bitmask_set* thisLeaks;
 	MemoryReferer* ref;
     int i;
 
@@ -77,25 +82,39 @@ cbObjectTagReferrer(jvmtiHeapReferenceKind reference_kind,
 		return JVMTI_VISIT_OBJECTS;
 	}
     data = (FollowReferencesData*)user_data;
-    thisNode = (MemoryNode*)(intptr_t)*tag_ptr;
+    nodes = &getThreadData()->nodes;
+    thisNode = NODE_ID_OF_TAG(*tag_ptr);
+    thisLeaks = &NODE_FIELD(nodes, thisNode, leaks_related);
 
-	if (bitMapSet_containsAll(data->leaks_finished, thisNode->leaks_related))
+	if (bitMapSet_containsAll(data->leaks_finished, thisLeaks))
 	{
 		return JVMTI_VISIT_OBJECTS;
 	}
-	if (bitMapSet_isEmpty(thisNode->leaks_related))
+	if (bitMapSet_isEmpty(thisLeaks))
 	{
 		return JVMTI_VISIT_OBJECTS;
 	}
+	if (isAllocatorBudgetExhausted())
+	{
+		/* keep what was captured so far, chains that reached a root are still complete */
+		if (!data->budget_exhausted)
+		{
+			alert("jleaker: Agent memory budget of %d MB reached, reference chains may be partial\n", gdata->max_agent_memory_mb);
+			data->budget_exhausted = JNI_TRUE;
+		}
+		return JVMTI_VISIT_ABORT;
+	}
 
-    if (0L != referrer_class_tag)
+    if (IS_NODE_TAG(referrer_class_tag))
     {
-    	int refsFromSameClass = addReferenceClass(thisNode, (MemoryNode*)(intptr_t)referrer_class_tag);
+    	int refsFromSameClass;
+    	refClassNode = NODE_ID_OF_TAG(referrer_class_tag);
+    	refsFromSameClass = addReferenceClass(thisNode, refClassNode);
     	if (refsFromSameClass >= gdata->max_fan_in)
     	{
     		return JVMTI_VISIT_OBJECTS;
     	}
-    	if (reference_kind == JVMTI_HEAP_REFERENCE_FIELD && isFieldIgnored((MemoryNode*)(intptr_t)referrer_class_tag, thisNode, reference_info->field.index))
+    	if (reference_kind == JVMTI_HEAP_REFERENCE_FIELD && isFieldIgnored(nodes, refClassNode, thisNode, reference_info->field.index))
     	{
     		debug("Ignoring field %d\n", reference_info->field.index);
     		return JVMTI_VISIT_OBJECTS;
@@ -105,109 +124,126 @@ cbObjectTagReferrer(jvmtiHeapReferenceKind reference_kind,
     if (NULL == referrer_tag_ptr)
     {
     	/* Referrer is not a class */
-    	refNode = NULL;
+    	refNode = NO_NODE;
     }
     else if ( 0L != *referrer_tag_ptr )
     {
-    	refNode = (MemoryNode*)(intptr_t)*referrer_tag_ptr;
-    	if (reference_kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD && isFieldIgnored(refNode, thisNode, reference_info->field.index))
+    	refNode = NODE_ID_OF_TAG(*referrer_tag_ptr);
+    	if (reference_kind == JVMTI_HEAP_REFERENCE_STATIC_FIELD && isFieldIgnored(nodes, refNode, thisNode, reference_info->field.index))
     	{
     		debug("Ignoring static field %d\n", reference_info->field.index);
     		return JVMTI_VISIT_OBJECTS;
     	}
-    	if (hasReferenceBetweenObjects(thisNode, refNode, reference_kind, reference_info))
+    	if (!registerReferenceEdge(thisNode, refNode, reference_kind, reference_info))
     	{
     		return JVMTI_VISIT_OBJECTS;
     	}
-        refNode->reference_pointing_to_me++;
     }
     else
     {
     	refNode = newMemoryNode();
         /* If the referrer can be tagged, and hasn't been tagged, tag it */
-        *referrer_tag_ptr = (jlong)(intptr_t)refNode;
+        *referrer_tag_ptr = NODE_TAG(refNode);
+        registerReferenceEdge(thisNode, refNode, reference_kind, reference_info);
     }
 
-	if (NULL != refNode)
+	if (NO_NODE != refNode)
 	{
-		bitMapSet_addAllWithExclusion(refNode->leaks_related, thisNode->leaks_related, data->leaks_finished);
-		if (refNode->leak_size < thisNode->leak_size)
+		jint* refLeakSize = &NODE_FIELD(nodes, refNode, leak_size);
+		bitMapSet_addAllWithExclusion(&NODE_FIELD(nodes, refNode, leaks_related), thisLeaks, data->leaks_finished);
+		if (*refLeakSize < NODE_FIELD(nodes, thisNode, leak_size))
 		{
-			refNode->leak_size = thisNode->leak_size;
+			*refLeakSize = NODE_FIELD(nodes, thisNode, leak_size);
 		}
 	}
 
-    ref = (MemoryReferer*)myAlloc(sizeof(*ref));
+    ref = (MemoryReferer*)arenaAlloc(&getThreadData()->refererArena, sizeof(*ref));
     memset(ref, 0, sizeof(*ref));
-    ref->node = refNode;
+    ref->edge.node = refNode;
 
-    if (NULL == thisNode->start)
-    {
-    	thisNode->start = ref;
-    	thisNode->last = ref;
-    }
-    else
-    {
-    	thisNode->last->next = ref;
-    	thisNode->last = ref;
-    }
-    if (NULL != reference_info)
-    {
-    	ref->info = *reference_info;
-    }
-    ref->kind = reference_kind;
+    ref->next = NODE_FIELD(nodes, thisNode, first_edge);
+    NODE_FIELD(nodes, thisNode, first_edge) = ref;
+    setEdgeInfo(&ref->edge, reference_kind, reference_info);
 
-    for (i = 0; i < gdata->numberOfLeaks; i++)
+    for (i = bitMapSet_nextWithExclusion(thisLeaks, data->leaks_finished, 0);
+    		i >= 0;
+    		i = bitMapSet_nextWithExclusion(thisLeaks, data->leaks_finished, i + 1))
     {
-    	if (bitMapSet_contains(thisNode->leaks_related, i) && !bitMapSet_contains(data->leaks_finished, i))
-    	{
-    		data->nodes_found[i]++;
-    	}
+    	data->nodes_found[i]++;
     }
 
     if (isRootReference(reference_kind))
     {
-    	bitMapSet_addAll(data->leaks_finished, thisNode->leaks_related);
+    	bitMapSet_addAll(data->leaks_finished, thisLeaks);
     }
 
 	return JVMTI_VISIT_OBJECTS;
 
 }
 
-static void fillClassIgnoreList(JNIEnv* jni, MemoryNode* node)
+static jboolean isClassInitialized(jclass klass)
 {
-	IgnoreField* ignoreFields = NULL;
 	jint status, err;
-	char* classname;
 
-	err = (*gdata->jvmti)->GetClassStatus(gdata->jvmti, node->obj, &status);
+	err = (*gdata->jvmti)->GetClassStatus(gdata->jvmti, klass, &status);
     check_jvmti_error(gdata->jvmti, err, "get class status");
-    if ((status & (JVMTI_CLASS_STATUS_INITIALIZED|JVMTI_CLASS_STATUS_PREPARED|JVMTI_CLASS_STATUS_VERIFIED)) !=
-    		(JVMTI_CLASS_STATUS_INITIALIZED|JVMTI_CLASS_STATUS_PREPARED|JVMTI_CLASS_STATUS_VERIFIED))
-    {
-    	return;
-    }
+    return (status & (JVMTI_CLASS_STATUS_INITIALIZED|JVMTI_CLASS_STATUS_PREPARED|JVMTI_CLASS_STATUS_VERIFIED)) ==
+    		(JVMTI_CLASS_STATUS_INITIALIZED|JVMTI_CLASS_STATUS_PREPARED|JVMTI_CLASS_STATUS_VERIFIED);
+}
 
-	classname = get_class_name(gdata->jvmti, jni, node->obj);
-	sm_get(gdata->ignore_referenced_by, classname, (void**)&ignoreFields);
+/* Long enough for practically every class name, longer ones are allocated */
+#define CLASSNAME_BUF_SIZE 256
+
+static void fillClassIgnoreList(JNIEnv* jni, MemoryNode* node)
+{
+	IgnoreField* ignoreFields = NULL;
+	jint err;
+	char classnameBuf[CLASSNAME_BUF_SIZE];
+	char* classname = classnameBuf;
+	char* sig;
+	int len;
+
+	err = (*gdata->jvmti)->GetClassSignature(gdata->jvmti, node->obj, &sig, NULL);
+	check_jvmti_error(gdata->jvmti, err, "get class signature");
+	len = signature_to_class_name(sig, classnameBuf, sizeof(classnameBuf));
+	deallocate(gdata->jvmti, sig);
+	if (len >= (int)sizeof(classnameBuf))
+	{
+		classname = get_class_name(gdata->jvmti, jni, node->obj);
+	}
+
+	/* most classes have no rules - only the ones hitting the index pay for the rest */
+	if (nameIndex_contains(gdata->rules->ignore_referenced_by_index, classname) && isClassInitialized(node->obj))
+	{
+		sm_get(gdata->rules->ignore_referenced_by, classname, (void**)&ignoreFields);
+	}
+	/* the rules outlive the dump, so each class gets its own copy with its field offsets */
 	if (NULL != ignoreFields)
 	{
-		node->ignore_fields = ignoreFields;
-		sm_put(gdata->ignore_referenced_by, classname, NULL);
-		while (NULL != ignoreFields)
+		IgnoreField** last = &node->ignore_fields;
+		for (; NULL != ignoreFields; ignoreFields = ignoreFields->next)
 		{
-			ignoreFields->field = getFieldOffset(gdata->jvmti, jni, node->obj, ignoreFields->fieldName);
-			debug("Field offset for [%s].[%s] is %d\n", classname, ignoreFields->fieldName, ignoreFields->field);
-			ignoreFields = ignoreFields->next;
+			IgnoreField* copy = (IgnoreField*)myAlloc(sizeof(*copy));
+			copy->fieldName = myStrdup(ignoreFields->fieldName);
+			copy->threshold = ignoreFields->threshold;
+			copy->field = getFieldOffset(gdata->jvmti, jni, node, copy->fieldName);
+			copy->next = NULL;
+			debug("Field offset for [%s].[%s] is %d\n", classname, copy->fieldName, copy->field);
+			*last = copy;
+			last = &copy->next;
 		}
 	}
-	myFree(classname);
+
+	if (classname != classnameBuf)
+	{
+		myFree(classname);
+	}
 }
 
 static void tagAllClasses()
 {
 	jint err, count;
-	int i, j;
+	int i;
 	jclass *classes;
 	ThreadData* tdata = getThreadData();
 	JNIEnv* jni = tdata->jni;
@@ -215,19 +251,17 @@ static void tagAllClasses()
     err = (*gdata->jvmti)->GetLoadedClasses(gdata->jvmti, &count, &classes);
     check_jvmti_error(gdata->jvmti, err, "get loaded classes");
 
-    tdata->classNodes = myAlloc(count*sizeof(MemoryNode*)+1);
-
-    for (i = 0, j = 0; i < count; i++)
+    for (i = 0; i < count; i++)
     {
-    	if (!(*jni)->CallBooleanMethod(jni, classes[i], tdata->metEquals, tdata->classClass))
+    	if (!(*jni)->IsSameObject(jni, classes[i], tdata->classClass))
     	{
-    		MemoryNode* node = newMemoryNode();
+    		NodeId id = newMemoryNode();
+    		MemoryNode* node = getMemoryNode(id);
     		node->obj = classes[i];
-    		node->classNode = JNI_TRUE;
+    		NODE_FIELD(&tdata->nodes, id, flags) |= NODE_FLAG_CLASS;
     		fillClassIgnoreList(jni, node);
-    		err = (*gdata->jvmti)->SetTag(gdata->jvmti, classes[i], (jlong)(intptr_t)node);
+    		err = (*gdata->jvmti)->SetTag(gdata->jvmti, classes[i], NODE_TAG(id));
     	    check_jvmti_error(gdata->jvmti, err, "set tag");
-    		tdata->classNodes[j++] = node;
     	}
     	else
     	{
@@ -236,7 +270,7 @@ static void tagAllClasses()
     		(*jni)->DeleteLocalRef(jni, classes[i]);
     	}
     }
-    tdata->classNodes[j] = NULL;
+    tdata->classesTagged = JNI_TRUE;
 
     deallocate(gdata->jvmti, classes);
 }
@@ -249,7 +283,7 @@ static void untagAllClasses()
 	ThreadData* tdata = getThreadData();
 	JNIEnv* jni = tdata->jni;
 
-	if (NULL == tdata->classNodes)
+	if (!tdata->classesTagged)
 	{
 		/* classes were'nt tagged */
 		return;
@@ -264,16 +298,8 @@ static void untagAllClasses()
     }
     deallocate(gdata->jvmti, classes);
 
-    for (i = 0; NULL != tdata->classNodes[i]; i++)
-    {
-    	if (!freeMemoryNode(tdata->classNodes[i]))
-    	{
-    		char* classname = get_class_name(gdata->jvmti, jni, classes[i]);
-    		alert("class not freed! %s remaining references to it: %d\n", classname, tdata->classNodes[i]->reference_pointing_to_me);
-    		myFree(classname);
-    	}
-    }
-    myFree(tdata->classNodes);
+    /* the class nodes themselves go away with the rest of the graph */
+    tdata->classesTagged = JNI_FALSE;
 }
 
 
@@ -289,7 +315,7 @@ static void tagReferencesChain()
 	tagAllClasses();
 
 	memset(&data,0,sizeof(data));
-	bms = bitMaskSet_new(gdata->numberOfLeaks);
+	bms = gdata->compressed_sets ? bitMaskSet_newCompressed(gdata->numberOfLeaks) : bitMaskSet_new(gdata->numberOfLeaks);
 	nodes_found = myAlloc(sizeof(*nodes_found)*gdata->numberOfLeaks);
 	data.leaks_finished = bms;
 	data.nodes_found = nodes_found;
@@ -307,6 +333,11 @@ static void tagReferencesChain()
     	memset(nodes_found,0,sizeof(*nodes_found)*gdata->numberOfLeaks);
     	err = (*gdata->jvmti)->FollowReferences(gdata->jvmti, JVMTI_HEAP_FILTER_UNTAGGED|JVMTI_HEAP_FILTER_CLASS_UNTAGGED, NULL, NULL, &heap_callbacks, &data);
     	check_jvmti_error(gdata->jvmti, err, "follow references");
+    	if (data.budget_exhausted)
+    	{
+    		stopTimer(&timer, "Heap iteration");
+    		break;
+    	}
     	for (j = 0; j < gdata->numberOfLeaks; j++)
     	{
     		int contains = bitMapSet_contains(bms, j);
@@ -318,6 +349,7 @@ static void tagReferencesChain()
     		}
     	}
 
+    	debug("%d of %d leaks reached a root\n", bitMapSet_cardinality(bms), gdata->numberOfLeaks);
     	stopTimer(&timer, "Heap iteration");
 
     	if (!hasUnfinished)
@@ -330,65 +362,160 @@ static void tagReferencesChain()
 	bitMaskSet_free(&bms);
 }
 
-jlong generateTagForClass(jvmtiEnv* jvmti, JNIEnv* jni_env, jclass theClass, jmethodID metGetEnclosingClass)
+/* The supertype closure of a class is kept as a tag on the class:
+ * bit j of the low word is set if the class is, extends or implements sizeable class j */
+#define CLOSURE_TAG_MARKER ((jlong)1 << 62)
+#define CLOSURE_SELF_EXCLUDED ((jlong)1 << 33)
+#define CLOSURE_CLASS_CLASS ((jlong)1 << 32)
+#define CLOSURE_MASK ((jlong)0xFFFFFFFF)
+
+/* Computes the supertype closure of a class, memoizing it as a tag in the given environment so
+ * every class of the hierarchy is visited once. Interfaces, arrays and nested classes are never
+ * sizeable by themselves, but still pass their bits on to the classes that inherit from them. */
+static jlong getSupertypeClosure(jvmtiEnv* jvmti, JNIEnv* jni_env, jclass theClass, ClassClassifier* classifier)
 {
+	jlong closure;
+	jint err, status, intr_count;
+	jclass super, *intr_ptr = NULL;
 	jboolean boolResult;
-	jobject enclosingClass;
-	void* isIgnore = NULL;
-	char* classname;
-	ThreadData* tdata = getThreadData();
+	char* sig;
 	int j;
 
-	if ((*jni_env)->CallBooleanMethod(jni_env, theClass, tdata->metEquals, tdata->classClass))
+	err = (*jvmti)->GetTag(jvmti, theClass, &closure);
+	check_jvmti_error(jvmti, err, "get tag");
+	if (0L != (closure & CLOSURE_TAG_MARKER))
 	{
-		return CLASS_CLASS_INITIAL_TAG;
+		return closure;
+	}
+
+	closure = CLOSURE_TAG_MARKER;
+	if ((*jni_env)->IsSameObject(jni_env, theClass, classifier->classClass))
+	{
+		closure |= CLOSURE_CLASS_CLASS;
+	}
+	for (j = 0; j < gdata->sizeableClassesNum; j++)
+	{
+		jclass klass = classifier->sizeableClasses[j].klass;
+		if ((NULL != klass) && (*jni_env)->IsSameObject(jni_env, theClass, klass))
+		{
+			closure |= ((jlong)1 << j);
+		}
+	}
+
+	super = (*jni_env)->GetSuperclass(jni_env, theClass);
+	if (NULL != super)
+	{
+		closure |= getSupertypeClosure(jvmti, jni_env, super, classifier) & CLOSURE_MASK;
+		(*jni_env)->DeleteLocalRef(jni_env, super);
+	}
+	err = (*jvmti)->GetImplementedInterfaces(jvmti, theClass, &intr_count, &intr_ptr);
+	if (JVMTI_ERROR_CLASS_NOT_PREPARED == err)
+	{
+		/* no instances yet - don't remember a partial closure */
+		return closure | CLOSURE_SELF_EXCLUDED;
+	}
+	check_jvmti_error(jvmti, err, "get implemented interfaces");
+	for (j = 0; j < intr_count; j++)
+	{
+		closure |= getSupertypeClosure(jvmti, jni_env, intr_ptr[j], classifier) & CLOSURE_MASK;
+		(*jni_env)->DeleteLocalRef(jni_env, intr_ptr[j]);
 	}
+	deallocate(jvmti, intr_ptr);
 
 	if (JNI_OK != (*jvmti)->IsInterface(jvmti, theClass, &boolResult) || (boolResult != JNI_FALSE))
-    {
-    	return 0L;
-    }
-    if (JNI_OK != (*jvmti)->IsArrayClass(jvmti, theClass, &boolResult) || (boolResult != JNI_FALSE))
-    {
-    	return 0L;
-    }
-    enclosingClass = (*jni_env)->CallObjectMethod(jni_env, theClass, metGetEnclosingClass);
-    if (NULL != enclosingClass)
-    {
-    	(*jni_env)->DeleteLocalRef(jni_env, enclosingClass);
-    	return 0L;
-    }
+	{
+		closure |= CLOSURE_SELF_EXCLUDED;
+	}
+	else if (JNI_OK != (*jvmti)->IsArrayClass(jvmti, theClass, &boolResult) || (boolResult != JNI_FALSE))
+	{
+		closure |= CLOSURE_SELF_EXCLUDED;
+	}
+	else if (0L != (closure & CLOSURE_MASK))
+	{
+		err = (*jvmti)->GetClassSignature(jvmti, theClass, &sig, NULL);
+		check_jvmti_error(jvmti, err, "get class signature");
+		if (is_nested_class_signature(sig))
+		{
+			closure |= CLOSURE_SELF_EXCLUDED;
+		}
+		deallocate(jvmti, sig);
+	}
+
+	err = (*jvmti)->SetTag(jvmti, theClass, closure);
+	check_jvmti_error(jvmti, err, "set tag");
+	return closure;
+}
+
+static jlong closureToClassTag(jlong closure)
+{
+	int j;
+	if (0L != (closure & CLOSURE_CLASS_CLASS))
+	{
+		return CLASS_CLASS_INITIAL_TAG;
+	}
+	if (0L != (closure & CLOSURE_SELF_EXCLUDED))
+	{
+		return 0L;
+	}
+	for (j = 0; j < gdata->sizeableClassesNum; j++)
+	{
+		if (0L != (closure & ((jlong)1 << j)))
+		{
+			return INITIAL_CLASS_TAG + j;
+		}
+	}
+	return 0L;
+}
+
+/* Classifies a class by its type alone: java.lang.Class, one of the sizeable classes or nothing.
+ * Doesn't depend on the configuration, so the result can be kept for the lifetime of the class.
+ * The supertype closures are memoized as tags in the given environment. */
+jlong classifyClass(jvmtiEnv* jvmti, JNIEnv* jni_env, jclass theClass, ClassClassifier* classifier)
+{
+	return closureToClassTag(getSupertypeClosure(jvmti, jni_env, theClass, classifier));
+}
+
+static jboolean isSizeableClassTag(jlong tag)
+{
+	return (tag >= INITIAL_CLASS_TAG) && (tag - INITIAL_CLASS_TAG < gdata->sizeableClassesNum);
+}
+
+jlong generateTagForClass(jvmtiEnv* jvmti, JNIEnv* jni_env, jclass theClass, ClassClassifier* classifier)
+{
+	jlong tag;
+	char* classname;
+
+	if (!getResidentClassTag(jni_env, theClass, &tag))
+	{
+		tag = classifyClass(jvmti, jni_env, theClass, classifier);
+	}
+	if (!isSizeableClassTag(tag))
+	{
+		return tag;
+	}
 
 	classname = get_class_name(gdata->jvmti, jni_env, theClass);
-	sm_get(gdata->ignore_classes, classname, &isIgnore);
-	if (NULL != isIgnore)
+	if (classPatterns_match(gdata->rules->ignore_classes, classname))
 	{
 		debug("Ignoring class %s\n", classname);
 		myFree(classname);
 		return 0L;
 	}
 	myFree(classname);
-
-    for (j = 0; j < gdata->sizeableClassesNum; j++)
-    {
-    	jclass klass = tdata->sizeableClasses[j].klass;
-    	if ((NULL != klass) && (*jni_env)->IsAssignableFrom(jni_env, theClass, klass))
-    	{
-    		return INITIAL_CLASS_TAG + j;
-    	}
-    }
-    return 0L;
+	return tag;
 }
 
 void tagAllMapsAndCollections()
 {
     jclass            *classes;
     jint               count, err;
-    jmethodID metGetEnclosingClass;
+    jlong             *classTags;
+    ClassClassifier classifier;
     jvmtiHeapCallbacks heapCallbacks;
 
     jvmtiEnv* jvmti = gdata->jvmti;
-    JNIEnv* jni_env = getThreadData()->jni;
+    ThreadData* tdata = getThreadData();
+    JNIEnv* jni_env = tdata->jni;
     int i;
     Timer timer;
 
@@ -400,16 +527,23 @@ void tagAllMapsAndCollections()
     err = (*jvmti)->GetLoadedClasses(jvmti, &count, &classes);
     check_jvmti_error(jvmti, err, "get loaded classes");
 
-    metGetEnclosingClass = (*jni_env)->GetMethodID(jni_env, getThreadData()->classClass, "getEnclosingClass", "()Ljava/lang/Class;");
+    classifier.classClass = tdata->classClass;
+    classifier.sizeableClasses = tdata->sizeableClasses;
 
-    /* Setup an area to hold details about these classes */
+    /* Classify everything before re-tagging, the memoized closures live in the same tags */
+    classTags = myAlloc(sizeof(*classTags) * (count + 1));
+    for ( i = 0 ; i < count ; i++ )
+    {
+    	classTags[i] = generateTagForClass(jvmti, jni_env, classes[i], &classifier);
+    }
     for ( i = 0 ; i < count ; i++ )
     {
         /* Tag this jclass */
-        err = (*jvmti)->SetTag(jvmti, classes[i], generateTagForClass(jvmti, jni_env, classes[i], metGetEnclosingClass));
+        err = (*jvmti)->SetTag(jvmti, classes[i], classTags[i]);
         check_jvmti_error(jvmti, err, "set object tag");
     	(*jni_env)->DeleteLocalRef(jni_env, classes[i]);
     }
+    myFree(classTags);
     deallocate(jvmti, classes);
 
     stopTimer(&timer, "Mark classes");
@@ -468,19 +602,37 @@ void findLeaksInTaggedObjects()
 
     if (NULL != lst)
     {
+    	Timer timer;
+
+    	startTimer(&timer, 1);
     	tagReferencesChain();
+    	if (!gdata->compact_graph)
+    	{
+    		orderReferenceLists();
+    	}
+    	stopTimer(&timer, "Reference graph capture");
+    	if (gdata->compact_graph)
+    	{
+    		startTimer(&timer, 1);
+    		compactReferenceGraph();
+    		stopTimer(&timer, "Reference graph compaction");
+    	}
+    	startTimer(&timer, 1);
     	printReferencesChainForLeakingNodes(lst, (gdata->reference_chain_length > 0));
+    	stopTimer(&timer, "Reference chains search and print");
     	freeMemoryForLeakList(lst);
     }
     myFree(sizeMethods);
     myFree(tags);
    	untagAllClasses();
+   	releaseAllMemoryNodes();
 }
 
 LeakingNodes* searchObjectsForLeaks(LeakCheckData* data)
 {
 	int i;
 	JNIEnv* env = getThreadData()->jni;
+	NodeStore* nodes = &getThreadData()->nodes;
 	LeakingNodes* res = NULL, *last = NULL;
 	for (i = 0; i < data->count ; i++)
 	{
@@ -501,7 +653,7 @@ LeakingNodes* searchObjectsForLeaks(LeakCheckData* data)
 			debug("leak #%d is of size %d\n", n->leakNumber, (int)size);
 			gdata->numberOfLeaks++;
 			n->node = newMemoryNode();
-			bitMapSet_add(n->node->leaks_related, n->leakNumber);
+			bitMapSet_add(&NODE_FIELD(nodes, n->node, leaks_related), n->leakNumber);
 			if (NULL == last)
 			{
 				res = n;
@@ -513,10 +665,10 @@ LeakingNodes* searchObjectsForLeaks(LeakCheckData* data)
 				last = n;
 			}
 			n->print_fn = fn;
-			n->node->obj = data->obj_ptr[i];
-			n->node->leak_size = size;
+			getMemoryNode(n->node)->obj = data->obj_ptr[i];
+			NODE_FIELD(nodes, n->node, leak_size) = size;
 			n->leak_size = size;
-			(*gdata->jvmti)->SetTag(gdata->jvmti, data->obj_ptr[i], (jlong)(intptr_t)n->node);
+			(*gdata->jvmti)->SetTag(gdata->jvmti, data->obj_ptr[i], NODE_TAG(n->node));
 		}
 		else
 		{
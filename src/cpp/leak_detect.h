@@ -7,6 +7,7 @@
 LeakingNodes* searchObjectsForLeaks(LeakCheckData* data);
 void findLeaksInTaggedObjects();
 void tagAllMapsAndCollections();
+jlong classifyClass(jvmtiEnv* jvmti, JNIEnv* jni_env, jclass theClass, ClassClassifier* classifier);
 void selfCheck();
 
 #endif
@@ -0,0 +1,135 @@
+#include "name_index.h"
+#include <string.h>
+#include "allocator.h"
+
+#define EMPTY_SLOT 0U
+
+static unsigned int capacityFor(int expected)
+{
+	unsigned int capacity = 16;
+	while (capacity < 2U * (unsigned int)expected)
+	{
+		capacity <<= 1;
+	}
+	return capacity;
+}
+
+NameIndex* nameIndex_new(int expected)
+{
+	NameIndex* idx = myAlloc(sizeof(*idx));
+	idx->capacity = capacityFor(expected);
+	idx->count = 0;
+	idx->hashes = myAlloc(sizeof(*idx->hashes) * idx->capacity);
+	memset(idx->hashes, 0, sizeof(*idx->hashes) * idx->capacity);
+	return idx;
+}
+
+NameIndex* nameIndex_load(const unsigned int* hashes, unsigned int capacity, unsigned int count)
+{
+	NameIndex* idx;
+	unsigned int used = 0, i;
+
+	/* lookups stop at an empty slot, so at most half of the slots may be used */
+	if ((0 == capacity) || (0 != (capacity & (capacity - 1))) || (2 * (size_t)count > capacity))
+	{
+		return NULL;
+	}
+	for (i = 0; i < capacity; i++)
+	{
+		if (EMPTY_SLOT != hashes[i])
+		{
+			used++;
+		}
+	}
+	if (used != count)
+	{
+		return NULL;
+	}
+	idx = myAlloc(sizeof(*idx));
+	idx->capacity = capacity;
+	idx->count = count;
+	idx->hashes = myAlloc(sizeof(*idx->hashes) * idx->capacity);
+	memcpy(idx->hashes, hashes, sizeof(*idx->hashes) * idx->capacity);
+	return idx;
+}
+
+void nameIndex_free(NameIndex** idx)
+{
+	if (NULL == *idx)
+	{
+		return;
+	}
+	myFree((*idx)->hashes);
+	myFree(*idx);
+	*idx = NULL;
+}
+
+/* FNV-1a, with 0 kept for empty slots */
+unsigned int nameIndex_hash(const char* name)
+{
+	unsigned int h = 2166136261U;
+	for (; *name; name++)
+	{
+		h ^= (unsigned char)*name;
+		h *= 16777619U;
+	}
+	return (EMPTY_SLOT == h) ? 1U : h;
+}
+
+static void insertHash(NameIndex* idx, unsigned int h)
+{
+	unsigned int mask = idx->capacity - 1;
+	unsigned int i = h & mask;
+	while (EMPTY_SLOT != idx->hashes[i])
+	{
+		if (h == idx->hashes[i])
+		{
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+	idx->hashes[i] = h;
+	idx->count++;
+}
+
+void nameIndex_add(NameIndex* idx, const char* name)
+{
+	if (2 * (idx->count + 1) > idx->capacity)
+	{
+		unsigned int* old = idx->hashes;
+		unsigned int oldCapacity = idx->capacity, i;
+
+		idx->capacity <<= 1;
+		idx->count = 0;
+		idx->hashes = myAlloc(sizeof(*idx->hashes) * idx->capacity);
+		memset(idx->hashes, 0, sizeof(*idx->hashes) * idx->capacity);
+		for (i = 0; i < oldCapacity; i++)
+		{
+			if (EMPTY_SLOT != old[i])
+			{
+				insertHash(idx, old[i]);
+			}
+		}
+		myFree(old);
+	}
+	insertHash(idx, nameIndex_hash(name));
+}
+
+int nameIndex_contains(const NameIndex* idx, const char* name)
+{
+	unsigned int h, mask, i;
+	if (NULL == idx)
+	{
+		return 0;
+	}
+	h = nameIndex_hash(name);
+	mask = idx->capacity - 1;
+	for (i = h & mask; EMPTY_SLOT != idx->hashes[i]; i = (i + 1) & mask)
+	{
+		if (h == idx->hashes[i])
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef __NAME_INDEX_H__
+#define __NAME_INDEX_H__
+
+/* A set of name hashes, used as a cheap pre-filter in front of the string maps:
+ * a miss is definite, a hit still has to be confirmed against the map */
+typedef struct
+{
+	unsigned int* hashes;
+	unsigned int capacity;
+	unsigned int count;
+} NameIndex;
+
+NameIndex* nameIndex_new(int expected);
+/* An index of the given hash slots, as kept by an earlier index. Returns NULL if they
+ * can't be an index of count names. */
+NameIndex* nameIndex_load(const unsigned int* hashes, unsigned int capacity, unsigned int count);
+void nameIndex_free(NameIndex** idx);
+unsigned int nameIndex_hash(const char* name);
+void nameIndex_add(NameIndex* idx, const char* name);
+int nameIndex_contains(const NameIndex* idx, const char* name);
+
+#endif
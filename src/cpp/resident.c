@@ -0,0 +1,104 @@
+#include "resident.h"
+#include "agent_util.h"
+#include "allocator.h"
+#include "leak_detect.h"
+#include <stdlib.h>
+
+/*
+ * Resident mode keeps a second JVMTI environment around for the lifetime of the agent.
+ * Each class is classified once, when it is prepared, and its supertype closure is kept as
+ * the tag of the class in that environment. Tags are per environment, so the dumps are free to
+ * re-tag classes in the main environment, and a class that is unloaded takes its entry with it.
+ */
+
+static jvmtiEnv* residentJvmti = NULL;
+static ClassClassifier residentClassifier;
+
+static void JNICALL
+cbClassPrepare(jvmtiEnv* jvmti, JNIEnv* jni, __UNUSED__ jthread thread, jclass klass)
+{
+	classifyClass(jvmti, jni, klass, &residentClassifier);
+}
+
+static void initResidentClassifier(JNIEnv* env)
+{
+	jclass klass;
+	int i;
+
+	memset(&residentClassifier, 0, sizeof(residentClassifier));
+	klass = (*env)->FindClass(env, "java/lang/Class");
+	residentClassifier.classClass = (jclass)(*env)->NewGlobalRef(env, klass);
+	(*env)->DeleteLocalRef(env, klass);
+
+	/* lives as long as the agent, so it stays out of the per-dump allocation check */
+	residentClassifier.sizeableClasses = malloc(sizeof(*residentClassifier.sizeableClasses)*gdata->sizeableClassesNum);
+	for (i = 0; i < gdata->sizeableClassesNum; i++)
+	{
+		klass = (*env)->FindClass(env, gdata->sizeableClasses[i].classname);
+		if (NULL == klass)
+		{
+			(*env)->ExceptionClear(env);
+			residentClassifier.sizeableClasses[i].klass = NULL;
+			continue;
+		}
+		residentClassifier.sizeableClasses[i].klass = (jclass)(*env)->NewGlobalRef(env, klass);
+		(*env)->DeleteLocalRef(env, klass);
+	}
+}
+
+jboolean enableResidentClassifier(JavaVM* vm)
+{
+	JNIEnv* env = NULL;
+	jvmtiEnv* jvmti = NULL;
+	jvmtiCapabilities capabilities;
+	jvmtiEventCallbacks callbacks;
+	jint rc;
+	jvmtiError err;
+
+	if (NULL != residentJvmti)
+	{
+		return JNI_TRUE;
+	}
+	rc = (*vm)->GetEnv(vm, (void**)&env, JNI_VERSION_1_2);
+	if (JNI_OK != rc)
+	{
+		alert("Resident mode: cannot get JNI environment, error=%d\n", rc);
+		return JNI_FALSE;
+	}
+	rc = (*vm)->GetEnv(vm, (void**)&jvmti, JVMTI_VERSION);
+	if (JNI_OK != rc)
+	{
+		alert("Resident mode: cannot create jvmtiEnv, error=%d\n", rc);
+		return JNI_FALSE;
+	}
+
+	memset(&capabilities, 0, sizeof(capabilities));
+	capabilities.can_tag_objects = 1;
+	err = (*jvmti)->AddCapabilities(jvmti, &capabilities);
+	check_jvmti_error(jvmti, err, "add capabilities (resident)");
+
+	initResidentClassifier(env);
+
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.ClassPrepare = &cbClassPrepare;
+	err = (*jvmti)->SetEventCallbacks(jvmti, &callbacks, sizeof(callbacks));
+	check_jvmti_error(jvmti, err, "set event callbacks (resident)");
+	err = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL);
+	check_jvmti_error(jvmti, err, "set event notifications (resident)");
+
+	residentJvmti = jvmti;
+	debug("jleaker: resident class classifier enabled\n");
+	return JNI_TRUE;
+}
+
+/* Returns the classification kept for the class, classifying it on the spot if it was
+ * prepared before resident mode was enabled. Returns JNI_FALSE if resident mode is off. */
+jboolean getResidentClassTag(JNIEnv* jni, jclass klass, jlong* tag)
+{
+	if (NULL == residentJvmti)
+	{
+		return JNI_FALSE;
+	}
+	*tag = classifyClass(residentJvmti, jni, klass, &residentClassifier);
+	return JNI_TRUE;
+}
@@ -0,0 +1,10 @@
+#ifndef __RESIDENT_H__
+#define __RESIDENT_H__
+
+#include <jvmti.h>
+#include "data_struct.h"
+
+jboolean enableResidentClassifier(JavaVM* vm);
+jboolean getResidentClassTag(JNIEnv* jni, jclass klass, jlong* tag);
+
+#endif
@@ -8,6 +8,8 @@
  *	  2.0.0 - changed function prefix from strmap to sm to ensure
  *	      ANSI C compatibility 
  *	  2.0.1 - improved documentation 
+ *	  2.1.0 - open addressing with stored hash codes, grows as needed,
+ *	      FNV-1a hash with a MurmurHash3 finalizer
  *
  *    strmap.c
  *
@@ -36,83 +38,77 @@
  */
 #include "strmap.h"
 
-typedef struct Pair Pair;
+/* The table never holds more than 3/4 of its slots, so probe runs stay short */
+#define MIN_SLOTS 16
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
 
-typedef struct Bucket Bucket;
+typedef struct Slot Slot;
 
-struct Pair {
+struct Slot {
+	/* null for an empty slot */
 	char *key;
 	void *value;
-};
-
-struct Bucket {
-	unsigned int count;
-	Pair *pairs;
+	/* the full hash of the key, so probes and growing don't rehash or strcmp needlessly */
+	unsigned int hash;
 };
 
 struct StrMap {
+	/* a power of two */
+	unsigned int capacity;
 	unsigned int count;
-	Bucket *buckets;
+	Slot *slots;
 	sm_free_func free_func;
 };
 
-static Pair * get_pair(Bucket *bucket, const char *key);
-static unsigned long hash(const char *str);
+static Slot * find_slot(Slot *slots, unsigned int capacity, const char *key, unsigned int hash);
+static int grow(StrMap *map);
+static unsigned int hash(const char *str);
 
 StrMap * sm_new(unsigned int capacity, sm_free_func free_func)
 {
 	StrMap *map;
-	
+	unsigned int slots = MIN_SLOTS;
+
+	while (slots * MAX_LOAD_NUM < capacity * MAX_LOAD_DEN) {
+		slots *= 2;
+	}
 	map = malloc(sizeof(StrMap));
 	if (map == NULL) {
 		return NULL;
 	}
-	map->count = capacity;
-	map->buckets = malloc(map->count * sizeof(Bucket));
-	if (map->buckets == NULL) {
+	map->capacity = slots;
+	map->count = 0;
+	map->slots = calloc(map->capacity, sizeof(Slot));
+	if (map->slots == NULL) {
 		free(map);
 		return NULL;
 	}
-	memset(map->buckets, 0, map->count * sizeof(Bucket));
 	map->free_func = free_func;
 	return map;
 }
 
 void sm_delete(StrMap *map)
 {
-	unsigned int i, j, n, m;
-	Bucket *bucket;
-	Pair *pair;
+	unsigned int i;
+	Slot *slot;
 
 	if (map == NULL) {
 		return;
 	}
-	n = map->count;
-	bucket = map->buckets;
-	i = 0;
-	while (i < n) {
-		m = bucket->count;
-		pair = bucket->pairs;
-		j = 0;
-		while(j < m) {
-			free(pair->key);
-			(*map->free_func)(pair->value);
-			pair++;
-			j++;
+	for (i = 0, slot = map->slots; i < map->capacity; i++, slot++) {
+		if (slot->key != NULL) {
+			free(slot->key);
+			(*map->free_func)(slot->value);
 		}
-		free(bucket->pairs);
-		bucket++;
-		i++;
 	}
-	free(map->buckets);
+	free(map->slots);
 	free(map);
 }
 
 int sm_get(const StrMap *map, const char *key, void** res)
 {
-	unsigned int index;
-	Bucket *bucket;
-	Pair *pair;
+	Slot *slot;
 
 	if (map == NULL) {
 		return 0;
@@ -120,42 +116,29 @@ int sm_get(const StrMap *map, const char *key, void** res)
 	if (key == NULL) {
 		return 0;
 	}
-	index = hash(key) % map->count;
-	bucket = &(map->buckets[index]);
-	pair = get_pair(bucket, key);
-	if (pair == NULL) {
+	slot = find_slot(map->slots, map->capacity, key, hash(key));
+	if (slot->key == NULL) {
 		return 0;
 	}
-	*res = pair->value;
+	*res = slot->value;
 	return 1;
 }
 
 int sm_exists(const StrMap *map, const char *key)
 {
-	unsigned int index;
-	Bucket *bucket;
-	Pair *pair;
-
 	if (map == NULL) {
 		return 0;
 	}
 	if (key == NULL) {
 		return 0;
 	}
-	index = hash(key) % map->count;
-	bucket = &(map->buckets[index]);
-	pair = get_pair(bucket, key);
-	if (pair == NULL) {
-		return 0;
-	}
-	return 1;
+	return find_slot(map->slots, map->capacity, key, hash(key))->key != NULL;
 }
 
 void* sm_put(StrMap *map, const char *key, void* value)
 {
-	unsigned int key_len, index;
-	Bucket *bucket;
-	Pair *tmp_pairs, *pair;
+	unsigned int key_hash;
+	Slot *slot;
 	char *new_key;
 
 	if (map == NULL) {
@@ -164,91 +147,44 @@ void* sm_put(StrMap *map, const char *key, void* value)
 	if (key == NULL) {
 		return NULL;
 	}
-	key_len = strlen(key);
-	/* Get a pointer to the bucket the key string hashes to */
-	index = hash(key) % map->count;
-	bucket = &(map->buckets[index]);
-	/* Check if we can handle insertion by simply replacing
-	 * an existing value in a key-value pair in the bucket.
-	 */
-	if ((pair = get_pair(bucket, key)) != NULL) {
-		void* old_value = pair->value;
-		/* Copy the new value into the pair that matches the key */
-		pair->value = value;
+	key_hash = hash(key);
+	slot = find_slot(map->slots, map->capacity, key, key_hash);
+	if (slot->key != NULL) {
+		/* Replace the value of the existing key */
+		void* old_value = slot->value;
+		slot->value = value;
 		return old_value;
 	}
-	/* Allocate space for a new key and value */
-	new_key = malloc((key_len + 1) * sizeof(char));
-	if (new_key == NULL) {
-		return NULL;
-	}
-	/* Create a key-value pair */
-	if (bucket->count == 0) {
-		/* The bucket is empty, lazily allocate space for a single
-		 * key-value pair.
-		 */
-		bucket->pairs = malloc(sizeof(Pair));
-		if (bucket->pairs == NULL) {
-			free(new_key);
+	if ((map->count + 1) * MAX_LOAD_DEN > map->capacity * MAX_LOAD_NUM) {
+		if (!grow(map)) {
 			return NULL;
 		}
-		bucket->count = 1;
+		slot = find_slot(map->slots, map->capacity, key, key_hash);
 	}
-	else {
-		/* The bucket wasn't empty but no pair existed that matches the provided
-		 * key, so create a new key-value pair.
-		 */
-		tmp_pairs = realloc(bucket->pairs, (bucket->count + 1) * sizeof(Pair));
-		if (tmp_pairs == NULL) {
-			free(new_key);
-			return NULL;
-		}
-		bucket->pairs = tmp_pairs;
-		bucket->count++;
+	new_key = malloc(strlen(key) + 1);
+	if (new_key == NULL) {
+		return NULL;
 	}
-	/* Get the last pair in the chain for the bucket */
-	pair = &(bucket->pairs[bucket->count - 1]);
-	pair->key = new_key;
-	pair->value = value;
-	/* Copy the key and its value into the key-value pair */
-	strcpy(pair->key, key);
+	strcpy(new_key, key);
+	slot->key = new_key;
+	slot->value = value;
+	slot->hash = key_hash;
+	map->count++;
 	return NULL;
 }
 
 int sm_get_count(const StrMap *map)
 {
-	unsigned int i, j, n, m;
-	unsigned int count;
-	Bucket *bucket;
-	Pair *pair;
-
 	if (map == NULL) {
 		return 0;
 	}
-	bucket = map->buckets;
-	n = map->count;
-	i = 0;
-	count = 0;
-	while (i < n) {
-		pair = bucket->pairs;
-		m = bucket->count;
-		j = 0;
-		while (j < m) {
-			count++;
-			pair++;
-			j++;
-		}
-		bucket++;
-		i++;
-	}
-	return count;
+	return map->count;
 }
 
 int sm_enum(const StrMap *map, sm_enum_func enum_func, const void *obj)
 {
-	unsigned int i, j, n, m;
-	Bucket *bucket;
-	Pair *pair;
+	unsigned int i;
+	Slot *slot;
 
 	if (map == NULL) {
 		return 0;
@@ -256,62 +192,79 @@ int sm_enum(const StrMap *map, sm_enum_func enum_func, const void *obj)
 	if (enum_func == NULL) {
 		return 0;
 	}
-	bucket = map->buckets;
-	n = map->count;
-	i = 0;
-	while (i < n) {
-		pair = bucket->pairs;
-		m = bucket->count;
-		j = 0;
-		while (j < m) {
-			enum_func(pair->key, pair->value, obj);
-			pair++;
-			j++;
+	for (i = 0, slot = map->slots; i < map->capacity; i++, slot++) {
+		if (slot->key != NULL) {
+			enum_func(slot->key, slot->value, obj);
 		}
-		bucket++;
-		i++;
 	}
 	return 1;
 }
 
 /*
- * Returns a pair from the bucket that matches the provided key,
- * or null if no such pair exist.
+ * Returns the slot holding the provided key, or the empty slot
+ * where it would be inserted.
  */
-static Pair * get_pair(Bucket *bucket, const char *key)
+static Slot * find_slot(Slot *slots, unsigned int capacity, const char *key, unsigned int hash)
 {
-	unsigned int i, n;
-	Pair *pair;
+	unsigned int mask = capacity - 1;
+	unsigned int i = hash & mask;
 
-	n = bucket->count;
-	if (n == 0) {
-		return NULL;
+	while (slots[i].key != NULL) {
+		if ((slots[i].hash == hash) && (strcmp(slots[i].key, key) == 0)) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return &slots[i];
+}
+
+/*
+ * Doubles the number of slots, moving the pairs by their stored hash.
+ * Returns 0 if the new slots could not be allocated.
+ */
+static int grow(StrMap *map)
+{
+	unsigned int i, capacity = map->capacity * 2;
+	Slot *slots = calloc(capacity, sizeof(Slot));
+
+	if (slots == NULL) {
+		return 0;
 	}
-	pair = bucket->pairs;
-	i = 0;
-	while (i < n) {
-		if (pair->key != NULL) {
-			if (strcmp(pair->key, key) == 0) {
-				return pair;
+	for (i = 0; i < map->capacity; i++) {
+		Slot *old = &map->slots[i];
+		if (old->key != NULL) {
+			unsigned int j = old->hash & (capacity - 1);
+			while (slots[j].key != NULL) {
+				j = (j + 1) & (capacity - 1);
 			}
+			slots[j] = *old;
 		}
-		pair++;
-		i++;
 	}
-	return NULL;
+	free(map->slots);
+	map->slots = slots;
+	map->capacity = capacity;
+	return 1;
 }
 
 /*
- * Returns a hash code for the provided string.
+ * Returns a hash code for the provided string: 32 bit FNV-1a, with
+ * the MurmurHash3 finalizer so the low bits used for the slot index
+ * depend on every character.
  */
-static unsigned long hash(const char *str)
+static unsigned int hash(const char *str)
 {
-	unsigned long hash = 5381;
-	int c;
+	unsigned int hash = 2166136261U;
+	unsigned char c;
 
-	while ((c = *str++)) {
-		hash = ((hash << 5) + hash) + c;
+	while ((c = (unsigned char)*str++)) {
+		hash ^= c;
+		hash *= 16777619U;
 	}
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6BU;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35U;
+	hash ^= hash >> 16;
 	return hash;
 }
 
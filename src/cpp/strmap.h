@@ -8,6 +8,8 @@
  *	  2.0.0 - changed function prefix from strmap to sm to ensure
  *	      ANSI C compatibility
  *	  2.0.1 - improved documentation 
+ *	  2.1.0 - open addressing with stored hash codes, grows as needed,
+ *	      FNV-1a hash with a MurmurHash3 finalizer
  *
  *    strmap.h
  *
@@ -73,8 +75,8 @@ typedef void(*sm_free_func)(void* value);
  *
  * Parameters:
  *
- * capacity: The number of top-level slots this string map
- * should allocate. This parameter must be > 0.
+ * capacity: The number of keys expected. The string map grows
+ * beyond it as needed.
  *
  * Return value: A pointer to a string map object, 
  * or null if a new string map could not be allocated.
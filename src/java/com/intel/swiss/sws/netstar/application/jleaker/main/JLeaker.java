@@ -23,6 +23,15 @@ public class JLeaker
 	private static final String ARG_NO_GC = "no-gc=b";
 	private static final String ARG_CONF_FILE = "conf-file=s";
 	private static final String ARG_CONSIDER_LOCAL_REF = "consider-local-references=b";
+	private static final String ARG_RESIDENT = "resident=b";
+	private static final String ARG_COMPRESSED_SETS = "compressed-sets=b";
+	private static final String ARG_MAX_AGENT_MEMORY_MB = "max-agent-memory-mb=i";
+	private static final String ARG_SCRATCH_DIR = "scratch-dir=s";
+	private static final String ARG_COMPACT_GRAPH = "compact-graph=b";
+	private static final String ARG_ALLOCATION_SITES = "allocation-sites=b";
+	private static final String ARG_HUGE_PAGES = "huge-pages=b";
+	private static final String ARG_CONF_CACHE = "conf-cache=s";
+	private static final String ARG_RELOAD_CONF = "reload-conf=b";
 	private static final String[] ALL_ARGS = {
 		ARG_LIB_PATH,
 		ARG_CONF_PATH,
@@ -35,7 +44,16 @@ public class JLeaker
 		ARG_CONF_FILE,
 		ARG_NO_GC,
 		ARG_SHOW_UNREACHABLES,
-		ARG_CONSIDER_LOCAL_REF
+		ARG_CONSIDER_LOCAL_REF,
+		ARG_RESIDENT,
+		ARG_COMPRESSED_SETS,
+		ARG_MAX_AGENT_MEMORY_MB,
+		ARG_SCRATCH_DIR,
+		ARG_COMPACT_GRAPH,
+		ARG_ALLOCATION_SITES,
+		ARG_HUGE_PAGES,
+		ARG_CONF_CACHE,
+		ARG_RELOAD_CONF
 	};
 	private int m_sizeThreshold;
 	private int m_referenceChainLength;
@@ -74,6 +92,15 @@ public class JLeaker
 		System.out.println("\t--no-gc \t\t\tDon't run garbage collection prior to the memory leak scanning (Default is to run GC)");
 		System.out.println("\t--conf-file <FILES> \t\tA list of JLeaker configuration files, separated by a '" + File.pathSeparatorChar + "' character");
 		System.out.println("\t--consider-local-references \tConsider local variable references and JNI local references as a heap root references (Default: No)");
+		System.out.println("\t--resident \t\t\tKeep classifying classes as they are loaded between dumps, so later dumps skip class marking (Default: No)");
+		System.out.println("\t--compressed-sets \t\tKeep per-object leak sets compressed, for runs with thousands of suspected leaks (Default: No)");
+		System.out.println("\t--max-agent-memory-mb <num> \tStop capturing the reference graph once the agent holds <num> MB of native memory, reporting partial chains (Default: no limit)");
+		System.out.println("\t--scratch-dir <DIR> \t\tKeep the reference graph in a memory-mapped file under <DIR>, for heaps too large for native memory (Default: in memory)");
+		System.out.println("\t--compact-graph \t\tPack the reference graph into flat arrays after the capture, so the chain search reads it sequentially (Default: No)");
+		System.out.println("\t--allocation-sites \t\tReport the agent's own native memory use per allocation site, current and peak (Default: No)");
+		System.out.println("\t--huge-pages \t\t\tKeep the reference graph on huge pages when the system has them, to cut TLB misses on large heaps (Default: No)");
+		System.out.println("\t--conf-cache <FILE> \t\tKeep the parsed configuration files in <FILE>, and load it instead while they are unchanged (Default: no cache)");
+		System.out.println("\t--reload-conf \t\t\tReload the configuration files even if they seem unchanged since the last attach (Default: reload only changed files)");
 		System.out.println();
 	}
 
@@ -87,11 +114,20 @@ public class JLeaker
 		m_pid = (Integer)parser.getValue(ARG_PID);
 		findReferenceChainLength(parser);
 		Integer maxFanIn = (Integer)parser.getValue(ARG_MAX_FAN_IN);
+		Integer maxAgentMemoryMb = (Integer)parser.getValue(ARG_MAX_AGENT_MEMORY_MB);
+		String scratchDir = (String)parser.getValue(ARG_SCRATCH_DIR);
+		String confCache = (String)parser.getValue(ARG_CONF_CACHE);
 		boolean debug = parser.exists(ARG_DEBUG);
 		boolean self_check = parser.exists(ARG_SELF_CHECK);
 		boolean show_unreachables = parser.exists(ARG_SHOW_UNREACHABLES);
 		boolean no_gc = parser.exists(ARG_NO_GC);
 		boolean consider_local_ref = parser.exists(ARG_CONSIDER_LOCAL_REF);
+		boolean resident = parser.exists(ARG_RESIDENT);
+		boolean compressed_sets = parser.exists(ARG_COMPRESSED_SETS);
+		boolean compact_graph = parser.exists(ARG_COMPACT_GRAPH);
+		boolean allocation_sites = parser.exists(ARG_ALLOCATION_SITES);
+		boolean huge_pages = parser.exists(ARG_HUGE_PAGES);
+		boolean reload_conf = parser.exists(ARG_RELOAD_CONF);
 		String confFile = (String)parser.getValue(ARG_CONF_FILE);
 		final String defaultConf = m_confPath + File.separator + "jleaker.conf";
 		if (debug)
@@ -106,6 +142,18 @@ public class JLeaker
 		{
 			m_more_options += "max_fan_in=" + maxFanIn + ",";
 		}
+		if (null != maxAgentMemoryMb)
+		{
+			m_more_options += "max_agent_memory_mb=" + maxAgentMemoryMb + ",";
+		}
+		if (null != scratchDir)
+		{
+			m_more_options += "scratch_dir=" + new File(scratchDir).getAbsolutePath() + ",";
+		}
+		if (null != confCache)
+		{
+			m_more_options += "conf_cache=" + new File(confCache).getAbsolutePath() + ",";
+		}
 		if (show_unreachables)
 		{
 			m_more_options += "show_unreachables,";
@@ -118,6 +166,30 @@ public class JLeaker
 		{
 			m_more_options += "consider_local_references,";
 		}
+		if (resident)
+		{
+			m_more_options += "resident,";
+		}
+		if (compressed_sets)
+		{
+			m_more_options += "compressed_sets,";
+		}
+		if (compact_graph)
+		{
+			m_more_options += "compact_graph,";
+		}
+		if (allocation_sites)
+		{
+			m_more_options += "allocation_sites,";
+		}
+		if (huge_pages)
+		{
+			m_more_options += "huge_pages,";
+		}
+		if (reload_conf)
+		{
+			m_more_options += "reload_conf,";
+		}
 		if (null != confFile)
 		{
 			StringTokenizer st = new StringTokenizer(confFile, File.pathSeparator);